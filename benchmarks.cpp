@@ -0,0 +1,447 @@
+// Microbenchmarks for the editor's hot paths on synthetic documents. Every benchmark runs in
+// its own forked process and prints one tab-separated record so runs can be compared by scripts:
+//   benchmark <name> <ops> <ns/op> <MB/s> <peak RSS growth KiB>
+// The RSS column is how far the process's peak rose above the RSS it started the benchmark with.
+// Benchmarks that cannot run print "skipped <name> <reason>" instead.
+#define HM2PP_NO_MAIN
+#include "main.cpp"
+
+#include <chrono>
+#include <cstdio>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+struct BenchmarkOptions {
+    BenchmarkOptions() : lines(10000), lineLength(80), edits(2000), repeat(5), seed(42),
+                         directory("/tmp"), encryptionLibrary("./encryption.dylib") {
+        mix[0] = 50;
+        mix[1] = 30;
+        mix[2] = 10;
+        mix[3] = 10;
+    }
+
+    size_t lines;
+    size_t lineLength;
+    size_t edits;
+    size_t repeat;
+    unsigned seed;
+    // Relative weights of insert, delete, undo and redo in the mixed edit benchmark.
+    unsigned mix[4];
+    std::string directory;
+    std::string encryptionLibrary;
+    std::string filter;
+};
+
+// One edit of a generated session. Line and position are chosen as fractions so the edit
+// stays valid whatever the document looks like when it is applied.
+struct SyntheticEdit {
+    enum Kind { kInsert, kDelete, kUndo, kRedo };
+
+    Kind kind;
+    double line;
+    double position;
+    size_t length;
+};
+
+class SyntheticDocument {
+public:
+    // Lines of lowercase words whose lengths vary around lineLength.
+    static std::vector<std::string> generate(size_t lineCount, size_t lineLength, unsigned seed) {
+        std::mt19937 generator(seed);
+        std::uniform_int_distribution<size_t> lengths(lineLength / 2, lineLength + lineLength / 2);
+        std::uniform_int_distribution<int> wordLengths(1, 10);
+        std::uniform_int_distribution<int> letters('a', 'z');
+
+        std::vector<std::string> lines(lineCount);
+        for (size_t i = 0; i < lineCount; i++) {
+            size_t length = lengths(generator);
+            std::string& line = lines[i];
+            line.reserve(length);
+            while (line.size() < length) {
+                if (!line.empty()) {
+                    line += ' ';
+                }
+                for (int w = wordLengths(generator); w > 0; w--) {
+                    line += static_cast<char>(letters(generator));
+                }
+            }
+        }
+        return lines;
+    }
+
+    static std::vector<SyntheticEdit> generateEdits(size_t count, const unsigned mix[4], unsigned seed) {
+        std::mt19937 generator(seed);
+        std::discrete_distribution<int> kinds(mix, mix + 4);
+        std::uniform_real_distribution<double> fraction(0.0, 1.0);
+        std::uniform_int_distribution<size_t> lengths(1, 16);
+
+        std::vector<SyntheticEdit> edits(count);
+        for (size_t i = 0; i < count; i++) {
+            edits[i].kind = static_cast<SyntheticEdit::Kind>(kinds(generator));
+            edits[i].line = fraction(generator);
+            edits[i].position = fraction(generator);
+            edits[i].length = lengths(generator);
+        }
+        return edits;
+    }
+
+    static size_t byteCount(const std::vector<std::string>& lines) {
+        size_t total = 0;
+        for (size_t i = 0; i < lines.size(); i++) {
+            total += lines[i].size() + 1;
+        }
+        return total;
+    }
+};
+
+class BenchmarkRunner {
+public:
+    explicit BenchmarkRunner(const BenchmarkOptions& options) : options(options), startRssKib(0) {
+        document = SyntheticDocument::generate(options.lines, options.lineLength, options.seed);
+        documentBytes = SyntheticDocument::byteCount(document);
+    }
+
+    void runAll() {
+        std::cout << "# name\tops\tns_per_op\tmb_per_s\tpeak_rss_growth_kib" << std::endl;
+        run("insert_substring", &BenchmarkRunner::insertSubstring);
+        run("delete_substring", &BenchmarkRunner::deleteSubstring);
+        run("undo_redo", &BenchmarkRunner::undoRedo);
+        run("edit_mix", &BenchmarkRunner::editMix);
+        run("search_substring", &BenchmarkRunner::searchSubstring);
+        run("search_after_edit", &BenchmarkRunner::searchAfterEdit);
+        run("files_save", &BenchmarkRunner::filesSave);
+        run("files_load", &BenchmarkRunner::filesLoad);
+        run("file_reader_writer", &BenchmarkRunner::fileReaderWriter);
+        run("encryption_round_trip", &BenchmarkRunner::encryptionRoundTrip);
+    }
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    const BenchmarkOptions& options;
+    std::vector<std::string> document;
+    size_t documentBytes;
+    long startRssKib;
+
+    bool selected(const std::string& name) const {
+        return options.filter.empty() || name.find(options.filter) != std::string::npos;
+    }
+
+    // ru_maxrss only ever grows, so a benchmark sharing the process would report the peak of
+    // whichever one before it used the most memory.
+    void run(const std::string& name, void (BenchmarkRunner::*benchmark)()) {
+        if (!selected(name)) {
+            return;
+        }
+
+        std::cout.flush();
+        pid_t child = fork();
+        if (child < 0) {
+            skip(name, "cannot fork");
+            return;
+        }
+        if (child == 0) {
+            startRssKib = peakRssKib();
+            (this->*benchmark)();
+            std::cout.flush();
+            _exit(0);
+        }
+
+        int status = 0;
+        if (waitpid(child, &status, 0) != child || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            skip(name, "benchmark process failed");
+        }
+    }
+
+    static double secondsSince(Clock::time_point start) {
+        return std::chrono::duration<double>(Clock::now() - start).count();
+    }
+
+    static long peakRssKib() {
+        struct rusage usage;
+        if (getrusage(RUSAGE_SELF, &usage) != 0) {
+            return -1;
+        }
+#ifdef __APPLE__
+        return usage.ru_maxrss / 1024;
+#else
+        return usage.ru_maxrss;
+#endif
+    }
+
+    void report(const std::string& name, size_t ops, double seconds, size_t bytes) const {
+        double nsPerOp = ops == 0 ? 0 : seconds * 1e9 / ops;
+        double mbPerSecond = seconds > 0 ? bytes / seconds / (1024.0 * 1024.0) : 0;
+        std::cout << "benchmark\t" << name << '\t' << ops << '\t' << nsPerOp << '\t' << mbPerSecond
+                  << '\t' << peakRssKib() - startRssKib << std::endl;
+    }
+
+    static void skip(const std::string& name, const std::string& reason) {
+        std::cout << "skipped\t" << name << '\t' << reason << std::endl;
+    }
+
+    std::string path(const std::string& name) const {
+        return options.directory + "/hm2pp_bench_" + name + ".txt";
+    }
+
+    static int lineFor(const StringArray& stringArray, double fraction) {
+        size_t count = stringArray.getStringCount();
+        return static_cast<int>(std::min(count - 1, static_cast<size_t>(fraction * count))) + 1;
+    }
+
+    // Applies one generated edit; returns the bytes it inserted or removed.
+    static size_t apply(StringArray& stringArray, const SyntheticEdit& edit, const std::string& text) {
+        int line = lineFor(stringArray, edit.line);
+        size_t lineLength = stringArray.getLines().length(line - 1);
+        switch (edit.kind) {
+            case SyntheticEdit::kDelete:
+            case SyntheticEdit::kInsert: {
+                // Lines too short to delete from are grown instead.
+                if (edit.kind == SyntheticEdit::kDelete && lineLength > edit.length) {
+                    int position = static_cast<int>(edit.position * (lineLength - edit.length));
+                    stringArray.deleteSubstring(line, position, static_cast<int>(edit.length));
+                } else {
+                    int position = static_cast<int>(edit.position * lineLength);
+                    stringArray.insertSubstring(line, position, text.substr(0, edit.length));
+                }
+                return edit.length;
+            }
+            case SyntheticEdit::kUndo:
+                stringArray.undo();
+                return 0;
+            case SyntheticEdit::kRedo:
+                stringArray.redo();
+                return 0;
+        }
+        return 0;
+    }
+
+    void runEdits(const std::string& name, const unsigned mix[4]) {
+        StringArray stringArray;
+        stringArray.setStrings(document);
+        std::vector<SyntheticEdit> edits = SyntheticDocument::generateEdits(options.edits, mix, options.seed);
+        const std::string text = "0123456789abcdef";
+
+        size_t bytes = 0;
+        Clock::time_point start = Clock::now();
+        for (size_t i = 0; i < edits.size(); i++) {
+            bytes += apply(stringArray, edits[i], text);
+        }
+        report(name, edits.size(), secondsSince(start), bytes);
+    }
+
+    void insertSubstring() {
+        const unsigned mix[4] = {1, 0, 0, 0};
+        runEdits("insert_substring", mix);
+    }
+
+    void deleteSubstring() {
+        const unsigned mix[4] = {0, 1, 0, 0};
+        runEdits("delete_substring", mix);
+    }
+
+    void editMix() {
+        runEdits("edit_mix", options.mix);
+    }
+
+    // Undo is limited to three steps in a row, so the benchmark alternates undo and redo
+    // after building up some history.
+    void undoRedo() {
+        StringArray stringArray;
+        stringArray.setStrings(document);
+        for (int i = 0; i < 4; i++) {
+            stringArray.insertSubstring(1, 0, "x");
+        }
+
+        Clock::time_point start = Clock::now();
+        for (size_t i = 0; i < options.edits; i++) {
+            stringArray.undo();
+            stringArray.redo();
+        }
+        report("undo_redo", options.edits * 2, secondsSince(start), 0);
+    }
+
+    // A fresh SearchCache every round, so each search scans the whole document as the
+    // editor's first search for a substring does.
+    void searchSubstring() {
+        StringArray stringArray;
+        stringArray.setStrings(document);
+
+        Clock::time_point start = Clock::now();
+        for (size_t i = 0; i < options.repeat; i++) {
+            SearchCache searchCache;
+            searchCache.search(stringArray, "qzx");
+        }
+        report("search_substring", options.repeat, secondsSince(start), documentBytes * options.repeat);
+    }
+
+    // Repeats one search between edits, which the cache answers by rescanning edited lines.
+    void searchAfterEdit() {
+        StringArray stringArray;
+        stringArray.setStrings(document);
+        SearchCache searchCache;
+        searchCache.search(stringArray, "qzx");
+
+        const unsigned mix[4] = {1, 1, 0, 0};
+        std::vector<SyntheticEdit> edits = SyntheticDocument::generateEdits(options.edits, mix, options.seed);
+        const std::string text = "0123456789abcdef";
+
+        Clock::time_point start = Clock::now();
+        for (size_t i = 0; i < edits.size(); i++) {
+            apply(stringArray, edits[i], text);
+            searchCache.search(stringArray, "qzx");
+        }
+        report("search_after_edit", edits.size(), secondsSince(start), 0);
+    }
+
+    void filesSave() {
+        ArenaLineStore lines;
+        lines.assign(document);
+        std::string fileName = path("files");
+        Clock::time_point start = Clock::now();
+        for (size_t i = 0; i < options.repeat; i++) {
+            if (!FilesSL::saveToFile(fileName, lines, false)) {
+                skip("files_save", "cannot write " + fileName);
+                return;
+            }
+        }
+        report("files_save", options.repeat, secondsSince(start), documentBytes * options.repeat);
+    }
+
+    void filesLoad() {
+        ArenaLineStore lines;
+        lines.assign(document);
+        std::string fileName = path("files");
+        if (!FilesSL::saveToFile(fileName, lines, false)) {
+            skip("files_load", "cannot write " + fileName);
+            return;
+        }
+
+        Clock::time_point start = Clock::now();
+        for (size_t i = 0; i < options.repeat; i++) {
+            if (!FilesSL::loadIntoStore(fileName, lines, false)) {
+                skip("files_load", "cannot read " + fileName);
+                return;
+            }
+        }
+        report("files_load", options.repeat, secondsSince(start), documentBytes * options.repeat);
+        std::remove(fileName.c_str());
+    }
+
+    // FileWriter refuses to overwrite, so each round trip removes the file first.
+    void fileReaderWriter() {
+        std::string content;
+        content.reserve(documentBytes);
+        for (size_t i = 0; i < document.size(); i++) {
+            content += document[i];
+            content += '\n';
+        }
+
+        FileReader reader;
+        FileWriter writer;
+        std::string fileName = path("reader_writer");
+        try {
+            Clock::time_point start = Clock::now();
+            for (size_t i = 0; i < options.repeat; i++) {
+                std::remove(fileName.c_str());
+                writer.Write(fileName, content);
+                if (reader.Read(fileName).size() != content.size()) {
+                    throw std::runtime_error("Read back a different size.");
+                }
+            }
+            report("file_reader_writer", options.repeat, secondsSince(start), 2 * content.size() * options.repeat);
+        } catch (const std::exception &e) {
+            skip("file_reader_writer", e.what());
+        }
+        std::remove(fileName.c_str());
+    }
+
+    void encryptionRoundTrip() {
+        EncryptionLibrary library(options.encryptionLibrary);
+        if (!library.isLoaded()) {
+            skip("encryption_round_trip", "cannot load " + options.encryptionLibrary);
+            return;
+        }
+
+        std::string content;
+        for (size_t i = 0; i < document.size() && content.size() < (1 << 20); i++) {
+            content += document[i];
+            content += '\n';
+        }
+
+        Clock::time_point start = Clock::now();
+        for (size_t i = 0; i < options.repeat; i++) {
+            std::string restored = library.decrypt(library.encrypt(content, "7"), "7");
+            if (restored != content) {
+                skip("encryption_round_trip", "decrypted text differs from the input");
+                return;
+            }
+        }
+        report("encryption_round_trip", options.repeat, secondsSince(start), 2 * content.size() * options.repeat);
+    }
+};
+
+static bool parseOptions(int argc, char* argv[], BenchmarkOptions& options) {
+    for (int i = 1; i < argc; i++) {
+        std::string name = argv[i];
+        if (i + 1 >= argc) {
+            std::cerr << "Missing value for " << name << "." << std::endl;
+            return false;
+        }
+        std::string value = argv[++i];
+
+        if (name == "--lines") {
+            options.lines = std::strtoul(value.c_str(), nullptr, 10);
+        } else if (name == "--line-length") {
+            options.lineLength = std::strtoul(value.c_str(), nullptr, 10);
+        } else if (name == "--edits") {
+            options.edits = std::strtoul(value.c_str(), nullptr, 10);
+        } else if (name == "--repeat") {
+            options.repeat = std::strtoul(value.c_str(), nullptr, 10);
+        } else if (name == "--seed") {
+            options.seed = static_cast<unsigned>(std::strtoul(value.c_str(), nullptr, 10));
+        } else if (name == "--mix") {
+            char comma;
+            std::istringstream weights(value);
+            if (!(weights >> options.mix[0] >> comma >> options.mix[1] >> comma >> options.mix[2]
+                          >> comma >> options.mix[3])) {
+                std::cerr << "--mix expects insert,delete,undo,redo weights." << std::endl;
+                return false;
+            }
+        } else if (name == "--dir") {
+            options.directory = value;
+        } else if (name == "--encryption-library") {
+            options.encryptionLibrary = value;
+        } else if (name == "--filter") {
+            options.filter = value;
+        } else {
+            std::cerr << "Unknown option " << name << "." << std::endl;
+            return false;
+        }
+    }
+
+    if (options.lines == 0 || options.lineLength < 2) {
+        std::cerr << "The document needs at least one line of two characters." << std::endl;
+        return false;
+    }
+    if (options.mix[0] + options.mix[1] + options.mix[2] + options.mix[3] == 0) {
+        std::cerr << "At least one --mix weight must be positive." << std::endl;
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char* argv[]) {
+    BenchmarkOptions options;
+    if (!parseOptions(argc, argv, options)) {
+        std::cerr << "Usage: benchmarks [--lines N] [--line-length N] [--edits N] [--repeat N] [--seed N]\n"
+                     "                  [--mix I,D,U,R] [--dir PATH] [--encryption-library PATH] [--filter NAME]"
+                  << std::endl;
+        return 1;
+    }
+
+    BenchmarkRunner runner(options);
+    runner.runAll();
+    return 0;
+}
@@ -2,330 +2,4580 @@
 #include <vector>
 #include <fstream>
 #include <stack>
+#include <deque>
 #include <string>
 #include <dlfcn.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <termios.h>
+#include <poll.h>
+#include <cerrno>
+#include <cstdint>
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
 #include <stdexcept>
 #include <random>
+#include <bitset>
+#include <map>
+#include <set>
+#include <limits>
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <sstream>
+#include <thread>
+#include <atomic>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <functional>
+#include <chrono>
+#include <unordered_set>
+#include <cstdio>
 
-class StringArray {
-private:
-    std::vector<std::string> array;
-    std::stack<std::vector<std::string>> historyStack;
-    std::stack<std::vector<std::string>> redoStack;
-    int consecutiveUndoCount;
-    std::string clipboard;
-
+// Latency histogram with HDR-style log-linear buckets: exact below 16 ns, then 16
+// sub-buckets per power of two, so every reported percentile is within about 6%.
+class LatencyHistogram {
 public:
-    StringArray() : consecutiveUndoCount(0) {
-        historyStack.push(array);
+    LatencyHistogram() : counts(kBucketCount, 0), count(0), totalNanoseconds(0), maxNanoseconds(0), bytes(0) {}
+
+    void record(unsigned long long nanoseconds, size_t touchedBytes) {
+        counts[bucketFor(nanoseconds)]++;
+        count++;
+        totalNanoseconds += nanoseconds;
+        maxNanoseconds = std::max(maxNanoseconds, nanoseconds);
+        bytes += touchedBytes;
     }
 
-    std::vector<std::string> getStrings() const {
-        return array;
+    // Upper bound of the bucket holding the given fraction of samples, capped at the maximum.
+    unsigned long long percentile(double fraction) const {
+        if (count == 0) {
+            return 0;
+        }
+        unsigned long long target = static_cast<unsigned long long>(fraction * count + 0.999999);
+        unsigned long long seen = 0;
+        for (size_t i = 0; i < counts.size(); i++) {
+            seen += counts[i];
+            if (seen >= std::max(target, 1ULL)) {
+                return std::min(bucketUpperBound(i), maxNanoseconds);
+            }
+        }
+        return maxNanoseconds;
     }
 
-    void setStrings(const std::vector<std::string>& data) {
-        array = data;
+    unsigned long long getCount() const {
+        return count;
     }
 
-    size_t getStringCount() const {
-        return array.size();
+    unsigned long long getTotalNanoseconds() const {
+        return totalNanoseconds;
     }
 
-    void addString(const std::string& buffer) {
-        if (!array.empty()) {
-            array.back() += buffer;
-        } else {
-            array.push_back(buffer);
-        }
-        historyStack.push(array);
-        redoStack = std::stack<std::vector<std::string>>();
-        consecutiveUndoCount = 0;
+    unsigned long long getMaxNanoseconds() const {
+        return maxNanoseconds;
     }
 
-    void addEmptyLine() {
-        array.push_back("");
-        historyStack.push(array);
-        redoStack = std::stack<std::vector<std::string>>();
-        consecutiveUndoCount = 0;
+    unsigned long long getBytes() const {
+        return bytes;
     }
 
-    void printStrings() {
-        for (size_t i = 0; i < array.size(); i++) {
-            std::cout << i + 1 << ": " << array[i] << std::endl;
+private:
+    enum { kSubBuckets = 16, kSubBucketBits = 4, kBucketCount = kSubBuckets * 61 };
+
+    std::vector<unsigned long long> counts;
+    unsigned long long count;
+    unsigned long long totalNanoseconds;
+    unsigned long long maxNanoseconds;
+    unsigned long long bytes;
+
+    static size_t bucketFor(unsigned long long value) {
+        if (value < kSubBuckets) {
+            return static_cast<size_t>(value);
         }
+        int exponent = 63 - __builtin_clzll(value);
+        size_t sub = static_cast<size_t>(value >> (exponent - kSubBucketBits)) - kSubBuckets;
+        return kSubBuckets + (exponent - kSubBucketBits) * kSubBuckets + sub;
     }
 
-    void deleteSubstring(int lineIndex, int position, int length) {
-        if (lineIndex < 1 || static_cast<size_t>(lineIndex) > array.size()) {
-            std::cerr << "Invalid line index." << std::endl;
-            return;
+    static unsigned long long bucketUpperBound(size_t bucket) {
+        if (bucket < kSubBuckets) {
+            return bucket;
         }
+        int shift = static_cast<int>((bucket - kSubBuckets) / kSubBuckets);
+        unsigned long long sub = (bucket - kSubBuckets) % kSubBuckets;
+        return ((kSubBuckets + sub + 1) << shift) - 1;
+    }
+};
 
-        std::string& line = array[lineIndex - 1];
+// Named latency histograms for editor operations. Operations run on the command thread,
+// so the histograms are not synchronised.
+class OperationStats {
+public:
+    static LatencyHistogram& histogram(const std::string& name) {
+        return registry()[name];
+    }
 
-        if (position < 0 || static_cast<size_t>(position) >= line.length()) {
-            std::cerr << "Invalid position." << std::endl;
+    static void print(std::ostream& output) {
+        std::map<std::string, LatencyHistogram>& histograms = registry();
+        if (histograms.empty()) {
+            output << "No operations recorded." << std::endl;
             return;
         }
 
-        if (length < 0 || static_cast<size_t>(position + length) > line.length()) {
-            std::cerr << "Invalid length." << std::endl;
-            return;
+        output << "operation\tcount\tp50_us\tp99_us\tmax_us\tbytes" << '\n';
+        for (std::map<std::string, LatencyHistogram>::const_iterator it = histograms.begin(); it != histograms.end(); ++it) {
+            const LatencyHistogram& h = it->second;
+            output << it->first << '\t' << h.getCount() << '\t' << h.percentile(0.5) / 1000.0 << '\t'
+                   << h.percentile(0.99) / 1000.0 << '\t' << h.getMaxNanoseconds() / 1000.0 << '\t' << h.getBytes() << '\n';
         }
-
-        clipboard = line.substr(position, length);
-        line.erase(position, length);
-        historyStack.push(array);
-        redoStack = std::stack<std::vector<std::string>>();
-        consecutiveUndoCount = 0;
+        output.flush();
     }
 
-    void undo() {
-        if (historyStack.size() > 1 && consecutiveUndoCount < 3) {
-            redoStack.push(array);
-            historyStack.pop();
-            array = historyStack.top();
-            consecutiveUndoCount++;
+    static void writeJson(std::ostream& output) {
+        std::map<std::string, LatencyHistogram>& histograms = registry();
+        output << "{\"operations\":[";
+        for (std::map<std::string, LatencyHistogram>::const_iterator it = histograms.begin(); it != histograms.end(); ++it) {
+            const LatencyHistogram& h = it->second;
+            output << (it == histograms.begin() ? "" : ",") << "\n  {\"name\":\"" << it->first
+                   << "\",\"count\":" << h.getCount() << ",\"p50_ns\":" << h.percentile(0.5)
+                   << ",\"p99_ns\":" << h.percentile(0.99) << ",\"max_ns\":" << h.getMaxNanoseconds()
+                   << ",\"total_ns\":" << h.getTotalNanoseconds() << ",\"bytes\":" << h.getBytes() << "}";
         }
+        output << "\n]}\n";
     }
 
-    void redo() {
-        if (!redoStack.empty()) {
-            historyStack.push(array);
-            array = redoStack.top();
-            redoStack.pop();
-            consecutiveUndoCount = 0;
-        }
+private:
+    static std::map<std::string, LatencyHistogram>& registry() {
+        static std::map<std::string, LatencyHistogram> histograms;
+        return histograms;
     }
+};
 
-    void insertSubstring(int lineIndex, int position, const std::string& substring, bool replace = false) {
-        if (lineIndex < 1 || static_cast<size_t>(lineIndex) > array.size()) {
-            std::cerr << "Invalid line index." << std::endl;
-            return;
-        }
-
-        if (position < 0 || static_cast<size_t>(position) > array[lineIndex - 1].length()) {
-            std::cerr << "Invalid position." << std::endl;
-            return;
-        }
+#ifndef HM2PP_NO_STATS
+// Records the lifetime of a scope, plus any bytes reported through touched(), into a histogram.
+class ScopedLatency {
+public:
+    explicit ScopedLatency(LatencyHistogram& histogram)
+        : histogram(histogram), start(std::chrono::steady_clock::now()), bytes(0) {}
 
-        if (replace) {
-            int length = substring.length();
-            array[lineIndex - 1].erase(position, length);
-            array[lineIndex - 1].insert(position, substring);
-        } else {
-            array[lineIndex - 1].insert(position, substring);
-        }
+    ~ScopedLatency() {
+        std::chrono::steady_clock::duration elapsed = std::chrono::steady_clock::now() - start;
+        histogram.record(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count(), bytes);
+    }
 
-        historyStack.push(array);
-        redoStack = std::stack<std::vector<std::string>>();
-        consecutiveUndoCount = 0;
+    void touched(size_t count) {
+        bytes += count;
     }
 
-    void cut(int lineIndex, int position, int length) {
-        if (lineIndex < 1 || static_cast<size_t>(lineIndex) > array.size()) {
-            std::cerr << "Invalid line index." << std::endl;
-            return;
-        }
+private:
+    LatencyHistogram& histogram;
+    std::chrono::steady_clock::time_point start;
+    size_t bytes;
+};
 
-        std::string& line = array[lineIndex - 1];
+// Times the rest of the enclosing scope as the named operation. The histogram is looked up
+// once per call site.
+#define TIME_OPERATION(timer, name) \
+    static LatencyHistogram& timer##Histogram = OperationStats::histogram(name); \
+    ScopedLatency timer(timer##Histogram)
+#else
+class ScopedLatency {
+public:
+    ScopedLatency() {}
 
-        if (position < 0 || static_cast<size_t>(position) >= line.length()) {
-            std::cerr << "Invalid position." << std::endl;
-            return;
-        }
+    void touched(size_t) {}
+};
 
-        if (length < 0 || static_cast<size_t>(position + length) > line.length()) {
-            std::cerr << "Invalid length." << std::endl;
-            return;
-        }
+#define TIME_OPERATION(timer, name) ScopedLatency timer
+#endif
 
-        clipboard = line.substr(position, length);
-        line.erase(position, length);
-        historyStack.push(array);
-        redoStack = std::stack<std::vector<std::string>>();
-        consecutiveUndoCount = 0;
+
+// Timeline of named spans that Chrome's about:tracing and Perfetto can open. Each thread
+// records into its own fixed-size ring, so recording takes no lock; a full ring overwrites
+// its oldest spans. Rings outlive their threads until written and are reused by new threads.
+class Timeline {
+public:
+    static bool isEnabled() {
+        return enabledFlag().load(std::memory_order_relaxed);
     }
 
-    void copy(int lineIndex, int position, int length) {
-        if (lineIndex < 1 || static_cast<size_t>(lineIndex) > array.size()) {
-            std::cerr << "Invalid line index." << std::endl;
-            return;
+    static void setEnabled(bool enabled) {
+        enabledFlag().store(enabled, std::memory_order_relaxed);
+    }
+
+    // Microseconds since the first call.
+    static unsigned long long now() {
+        static const std::chrono::steady_clock::time_point epoch = std::chrono::steady_clock::now();
+        return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - epoch).count();
+    }
+
+    static void record(const char* name, unsigned long long start, unsigned long long duration) {
+        Ring& ring = localRing();
+        unsigned long long index = ring.head.load(std::memory_order_relaxed);
+        Event& event = ring.events[index % kRingSize];
+        event.name.store(name, std::memory_order_relaxed);
+        event.start.store(start, std::memory_order_relaxed);
+        event.duration.store(duration, std::memory_order_relaxed);
+        event.threadId.store(ring.threadId, std::memory_order_relaxed);
+        ring.head.store(index + 1, std::memory_order_release);
+    }
+
+    // Writes the spans still held by every ring as trace-event JSON; returns the span count.
+    static size_t writeJson(std::ostream& output) {
+        std::vector<Ring*> rings;
+        {
+            std::lock_guard<std::mutex> lock(registryMutex());
+            rings = registry();
         }
 
-        const std::string& line = array[lineIndex - 1];
+        size_t written = 0;
+        output << "{\"traceEvents\":[";
+        for (size_t r = 0; r < rings.size(); r++) {
+            Ring& ring = *rings[r];
+            unsigned long long end = ring.head.load(std::memory_order_acquire);
+            unsigned long long begin = end > kRingSize ? end - kRingSize : 0;
+            std::vector<Event> copied(static_cast<size_t>(end - begin));
+            for (unsigned long long i = begin; i < end; i++) {
+                copy(ring.events[i % kRingSize], copied[static_cast<size_t>(i - begin)]);
+            }
 
-        if (position < 0 || static_cast<size_t>(position) >= line.length()) {
-            std::cerr << "Invalid position." << std::endl;
-            return;
+            // Spans the owner overwrote, or may be overwriting, while they were copied.
+            unsigned long long after = ring.head.load(std::memory_order_acquire);
+            unsigned long long valid = after + 1 > kRingSize ? after + 1 - kRingSize : 0;
+            for (unsigned long long i = std::max(begin, valid); i < end; i++) {
+                const Event& event = copied[static_cast<size_t>(i - begin)];
+                output << (written == 0 ? "" : ",") << "\n{\"name\":\"" << event.name.load()
+                       << "\",\"cat\":\"hm2pp\",\"ph\":\"X\",\"ts\":" << event.start.load() << ",\"dur\":"
+                       << event.duration.load() << ",\"pid\":" << getpid() << ",\"tid\":" << event.threadId.load() << "}";
+                written++;
+            }
         }
+        output << "\n],\"displayTimeUnit\":\"ms\"}\n";
+        return written;
+    }
 
-        if (length < 0 || static_cast<size_t>(position + length) > line.length()) {
-            std::cerr << "Invalid length." << std::endl;
-            return;
+private:
+    enum { kRingSize = 1 << 14 };
+
+    struct Event {
+        std::atomic<const char*> name;
+        std::atomic<unsigned long long> start;
+        std::atomic<unsigned long long> duration;
+        std::atomic<unsigned> threadId;
+    };
+
+    struct Ring {
+        explicit Ring(unsigned threadId) : head(0), threadId(threadId), inUse(true) {}
+
+        std::atomic<unsigned long long> head;
+        Event events[kRingSize];
+        unsigned threadId;
+        bool inUse;
+    };
+
+    // Returns the thread's ring to the registry when the thread exits. The spans it leaves
+    // behind keep their thread id; the next owner records under a new one.
+    struct RingOwner {
+        RingOwner() : ring(nullptr) {}
+
+        ~RingOwner() {
+            if (ring) {
+                std::lock_guard<std::mutex> lock(registryMutex());
+                ring->inUse = false;
+            }
         }
 
-        clipboard = line.substr(position, length);
+        Ring* ring;
+    };
+
+    static std::atomic<bool>& enabledFlag() {
+        static std::atomic<bool> enabled(false);
+        return enabled;
     }
 
-    void paste(int lineIndex, int position) {
-        if (lineIndex < 1 || static_cast<size_t>(lineIndex) > array.size()) {
-            std::cerr << "Invalid line index." << std::endl;
-            return;
-        }
+    static std::mutex& registryMutex() {
+        static std::mutex mutex;
+        return mutex;
+    }
 
-        if (position < 0 || static_cast<size_t>(position) > array[lineIndex - 1].length()) {
-            std::cerr << "Invalid position." << std::endl;
-            return;
+    static std::vector<Ring*>& registry() {
+        static std::vector<Ring*> rings;
+        return rings;
+    }
+
+    // Guarded by the registry mutex.
+    static unsigned& threadCount() {
+        static unsigned count = 0;
+        return count;
+    }
+
+    static Ring& localRing() {
+        static thread_local RingOwner owner;
+        if (!owner.ring) {
+            std::lock_guard<std::mutex> lock(registryMutex());
+            std::vector<Ring*>& rings = registry();
+            for (size_t i = 0; i < rings.size() && !owner.ring; i++) {
+                if (!rings[i]->inUse) {
+                    owner.ring = rings[i];
+                    owner.ring->inUse = true;
+                    owner.ring->threadId = ++threadCount();
+                }
+            }
+            if (!owner.ring) {
+                owner.ring = new Ring(++threadCount());
+                rings.push_back(owner.ring);
+            }
         }
+        return *owner.ring;
+    }
 
-        array[lineIndex - 1].insert(position, clipboard);
-        historyStack.push(array);
-        redoStack = std::stack<std::vector<std::string>>();
-        consecutiveUndoCount = 0;
+    static void copy(const Event& from, Event& to) {
+        to.name.store(from.name.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        to.start.store(from.start.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        to.duration.store(from.duration.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        to.threadId.store(from.threadId.load(std::memory_order_relaxed), std::memory_order_relaxed);
     }
 };
 
-class SearchFunctions {
+// Records the enclosing scope as a timeline span while the timeline is enabled.
+class TraceSpan {
 public:
-    static void searchSubstringInArray(const std::vector<std::string>& array, const std::string& substring) {
-        int foundCount = 0;
+    explicit TraceSpan(const char* name) : name(name), active(Timeline::isEnabled()), start(active ? Timeline::now() : 0) {}
 
-        for (size_t i = 0; i < array.size(); i++) {
-            size_t found = array[i].find(substring);
-            if (found != std::string::npos) {
-                std::cout << "Substring found in line " << i + 1 << " at position " << found << ": " << substring << std::endl;
-                foundCount++;
-            }
-        }
+    ~TraceSpan() {
+        finish();
+    }
 
-        if (foundCount == 0) {
-            std::cout << "Substring not found in any line." << std::endl;
+    // Ends the span before the scope does.
+    void finish() {
+        if (active) {
+            Timeline::record(name, start, Timeline::now() - start);
+            active = false;
         }
     }
+
+private:
+    const char* name;
+    bool active;
+    unsigned long long start;
 };
 
-class FilesSL {
+// Live and peak bytes per memory component, reported by whoever owns the memory.
+class MemoryStats {
 public:
-    static void saveToFile(const std::string& fileName, const std::vector<std::string>& data) {
-        std::ofstream file(fileName);
-        if (file.is_open()) {
-            for (const std::string& line : data) {
-                file << line << std::endl;
-            }
-            file.close();
-            std::cout << "Array saved to " << fileName << std::endl;
-        } else {
-            std::cerr << "Error opening the file." << std::endl;
-        }
+    static void update(const std::string& component, size_t liveBytes) {
+        Usage& usage = registry()[component];
+        usage.live = liveBytes;
+        usage.peak = std::max(usage.peak, liveBytes);
     }
 
-    static std::vector<std::string> loadFromFile(const std::string& fileName) {
-        std::vector<std::string> loadedData;
-        std::ifstream file(fileName);
-        if (file.is_open()) {
-            std::string line;
-            while (std::getline(file, line)) {
-                loadedData.push_back(line);
-            }
-            file.close();
-            std::cout << "Array loaded from " << fileName << std::endl;
-        } else {
-            std::cerr << "Error opening the file." << std::endl;
+    static void print(std::ostream& output) {
+        std::map<std::string, Usage>& components = registry();
+        size_t live = 0;
+        output << "component\tlive_bytes\tpeak_bytes" << '\n';
+        for (std::map<std::string, Usage>::const_iterator it = components.begin(); it != components.end(); ++it) {
+            output << it->first << '\t' << it->second.live << '\t' << it->second.peak << '\n';
+            live += it->second.live;
         }
-        return loadedData;
+        output << "total\t" << live << '\t' << '-' << std::endl;
     }
-};
 
-class IReader {
-public:
-    virtual ~IReader() {}
-    virtual std::string Read(const std::string& filePath) = 0;
+private:
+    struct Usage {
+        Usage() : live(0), peak(0) {}
+
+        size_t live;
+        size_t peak;
+    };
+
+    static std::map<std::string, Usage>& registry() {
+        static std::map<std::string, Usage> components;
+        return components;
+    }
 };
 
-class FileReader : public IReader {
+// Line storage backed by large append-only arenas. Each line is an (address, length)
+// descriptor into an arena instead of its own heap allocation; edited lines are copied
+// into a bump-allocated edit arena. Arenas are shared between copies of the store, so a
+// history snapshot only copies the descriptors.
+class ArenaLineStore {
 public:
-    std::string Read(const std::string& filePath) override {
-        std::ifstream file(filePath);
-        if (!file.is_open()) {
-            throw std::runtime_error("File not found.");
+    ArenaLineStore() : liveBytes(0), sharedLines(0), wordCount(0), charCount(0) {}
+
+    size_t size() const {
+        return slots.size();
+    }
+
+    bool empty() const {
+        return slots.empty();
+    }
+
+    const char* data(size_t index) const {
+        return slots[index].data;
+    }
+
+    size_t length(size_t index) const {
+        return slots[index].length;
+    }
+
+    std::string line(size_t index) const {
+        return std::string(slots[index].data, slots[index].length);
+    }
+
+    // Returns the line as a std::string, reusing scratch so scans do not allocate.
+    const std::string& fetch(size_t index, std::string& scratch) const {
+        scratch.assign(slots[index].data, slots[index].length);
+        return scratch;
+    }
+
+    size_t getLiveBytes() const {
+        return liveBytes;
+    }
+
+    // Bytes of line text actually held in arenas; lower than getLiveBytes() when identical
+    // lines share storage.
+    size_t getStoredBytes() const {
+        size_t total = 0;
+        for (size_t i = 0; i < arenas.size(); i++) {
+            total += arenas[i]->used;
         }
+        return total;
+    }
 
-        std::string content;
-        char buffer[128];
-        while (!file.eof()) {
-            file.read(buffer, sizeof(buffer));
-            content.append(buffer, file.gcount());
+    // Lines that pointed at the same bytes as an earlier identical line when the store was
+    // last interned, on load or compaction. Later edits do not update it.
+    size_t getSharedLines() const {
+        return sharedLines;
+    }
+
+    // Whitespace-separated words and UTF-8 characters in the line text, kept up to date by
+    // every mutator from the lines it stores and drops.
+    size_t getWordCount() const {
+        return wordCount;
+    }
+
+    size_t getCharCount() const {
+        return charCount;
+    }
+
+    // Byte length of the longest line. The first call after a load or a copy counts the
+    // line lengths; from then on every mutator keeps the counts current.
+    size_t getLongestLine() {
+        if (!lineLengths.isCounting()) {
+            lineLengths.start();
+            for (size_t i = 0; i < slots.size(); i++) {
+                lineLengths.add(slots[i].length);
+            }
         }
-        return content;
+        return lineLengths.longest();
     }
-};
 
-class IWriter {
-public:
-    virtual ~IWriter() {}
-    virtual void Write(const std::string& filePath, const std::string& content) = 0;
-};
+    size_t getDescriptorBytes() const {
+        return slots.capacity() * sizeof(LineSlot);
+    }
 
-class FileWriter : public IWriter {
-public:
-    void Write(const std::string& filePath, const std::string& content) override {
-        std::ifstream file(filePath);
-        if (file.good()) {
-            throw std::runtime_error("File already exists.");
+    // Capacity of the arenas not yet in seen, which it then records. Shared arenas are
+    // counted only by the first store that reports them.
+    size_t countNewArenaBytes(std::unordered_set<const void*>& seen) const {
+        size_t total = 0;
+        for (size_t i = 0; i < arenas.size(); i++) {
+            if (seen.insert(arenas[i].get()).second) {
+                total += arenas[i]->bytes.capacity();
+            }
         }
+        return total;
+    }
 
-        std::ofstream output(filePath, std::ios::binary);
+    // Shares ownership of every arena, so the line bytes stay readable from other threads
+    // after this store moves on. Written bytes are never modified.
+    void pinArenas(std::vector<std::shared_ptr<const void>>& pins) const {
+        pins.assign(arenas.begin(), arenas.end());
+    }
 
-        if (!output.is_open()) {
-            throw std::runtime_error("Unable to open the file for writing.");
+    size_t getArenaBytes() const {
+        size_t total = 0;
+        for (size_t i = 0; i < arenas.size(); i++) {
+            total += arenas[i]->capacity;
         }
+        return total;
+    }
 
-        const size_t chunkSize = 128;
-        for (size_t i = 0; i < content.size(); i += chunkSize) {
-            size_t chunkEnd = std::min(i + chunkSize, content.size());
-            output.write(content.c_str() + i, chunkEnd - i);
+    void assign(const std::vector<std::string>& lines) {
+        clear();
+        size_t total = 0;
+        for (size_t i = 0; i < lines.size(); i++) {
+            total += lines[i].size();
+        }
+
+        slots.reserve(lines.size());
+        reserveArena(total);
+        for (size_t i = 0; i < lines.size(); i++) {
+            slots.push_back(store(lines[i].data(), lines[i].size()));
+            countLine(lines[i].data(), lines[i].size());
         }
     }
-};
 
-class EncryptionLibrary {
-public:
-    EncryptionLibrary(const std::string &libraryPath) {
-        library_ = dlopen(libraryPath.c_str(), RTLD_LAZY);
-        if (!library_) {
-            std::cerr << "Failed to load the library: " << dlerror() << std::endl;
+    // Takes a whole file image as one arena and indexes its '\n'-separated lines, matching
+    // what a getline loop would produce. Large images are indexed by several threads.
+    void assignFileImage(std::vector<char>& image) {
+        TraceSpan span("ArenaLineStore::assignFileImage");
+        clear();
+        if (image.empty()) {
             return;
         }
 
-        encrypt_ = (EncryptFunction)dlsym(library_, "encrypt");
-        decrypt_ = (DecryptFunction)dlsym(library_, "decrypt");
+        std::shared_ptr<Arena> arena = std::make_shared<Arena>(0);
+        arena->bytes.swap(image);
+        arena->capacity = arena->used = arena->bytes.size();
+        arenas.push_back(arena);
+        std::vector<std::pair<unsigned long long, size_t>> sample;
+        liveBytes = indexLines(&arena->bytes[0], arena->bytes.size(), slots, wordCount, charCount, sample);
+        size_t newlines = slots.size() - (arena->bytes.back() == '\n' ? 0 : 1);
+        charCount -= newlines;
 
-        if (!encrypt_ || !decrypt_) {
-            std::cerr << "Failed to load functions: " << dlerror() << std::endl;
+        size_t duplicates = estimateDuplicateBytes(sample);
+        if (duplicates > 0 && duplicates * 4 >= liveBytes) {
+            TraceSpan internSpan("ArenaLineStore::assignFileImage intern");
+            rebuildInterned(liveBytes > duplicates ? liveBytes - duplicates : 0);
         }
     }
 
-    ~EncryptionLibrary() {
-        if (library_) {
-            dlclose(library_);
-        }
+    void pushBack(const std::string& text) {
+        slots.push_back(store(text.data(), text.size()));
+        countLine(text.data(), text.size());
     }
 
-    std::string encrypt(const std::string &inputText, const std::string &keyString) {
-        if (encrypt_) {
-            return encrypt_(inputText, keyString);
-        } else {
-            return "Encryption function not loaded";
-        }
+    void insertLine(size_t index, const std::string& text) {
+        slots.insert(slots.begin() + index, store(text.data(), text.size()));
+        countLine(text.data(), text.size());
     }
 
-    std::string decrypt(const std::string &inputText, const std::string &keyString) {
-        if (decrypt_) {
-            return decrypt_(inputText, keyString);
-        } else {
-            return "Decryption function not loaded";
+    void eraseLine(size_t index) {
+        uncountLine(index);
+        liveBytes -= slots[index].length;
+        slots.erase(slots.begin() + index);
+    }
+
+    void setLine(size_t index, const std::string& text) {
+        uncountLine(index);
+        liveBytes -= slots[index].length;
+        slots[index] = store(text.data(), text.size());
+        countLine(text.data(), text.size());
+    }
+
+    void clear() {
+        slots.clear();
+        arenas.clear();
+        liveBytes = 0;
+        sharedLines = 0;
+        wordCount = 0;
+        charCount = 0;
+        lineLengths.stop();
+    }
+
+    // Copies the live lines into one fresh arena once replaced lines waste more space
+    // than they hold. Arenas still referenced by history snapshots stay alive there.
+    bool compactIfFragmented() {
+        if (getArenaBytes() <= 2 * liveBytes + kArenaSize) {
+            return false;
+        }
+
+        rebuildInterned(liveBytes);
+        return true;
+    }
+
+private:
+    enum { kArenaSize = 1 << 20, kDuplicateSampling = 16 };
+
+    struct Arena {
+        explicit Arena(size_t capacity) : bytes(capacity), capacity(capacity), used(0) {}
+
+        std::vector<char> bytes;
+        size_t capacity;
+        size_t used;
+    };
+
+    struct LineSlot {
+        const char* data;
+        size_t length;
+    };
+
+    // Number of lines of each byte length, so the longest line survives edits to it. Short
+    // lengths are counted in a flat table. Counting starts on the first query; copies do not
+    // inherit it, because history snapshots are copies and would otherwise each carry a table.
+    class LineLengthCounts {
+    public:
+        LineLengthCounts() : counting(false), longestLength(0) {}
+
+        LineLengthCounts(const LineLengthCounts&) : counting(false), longestLength(0) {}
+
+        LineLengthCounts& operator=(const LineLengthCounts&) {
+            stop();
+            return *this;
+        }
+
+        LineLengthCounts(LineLengthCounts&& other) noexcept
+            : counting(other.counting), longestLength(other.longestLength) {
+            shortCounts.swap(other.shortCounts);
+            longCounts.swap(other.longCounts);
+            other.stop();
+        }
+
+        LineLengthCounts& operator=(LineLengthCounts&& other) noexcept {
+            counting = other.counting;
+            longestLength = other.longestLength;
+            shortCounts.swap(other.shortCounts);
+            longCounts.swap(other.longCounts);
+            other.stop();
+            return *this;
+        }
+
+        bool isCounting() const {
+            return counting;
+        }
+
+        void start() {
+            stop();
+            counting = true;
+            shortCounts.assign(kShortLengths, 0);
+        }
+
+        void stop() {
+            counting = false;
+            longestLength = 0;
+            std::vector<size_t>().swap(shortCounts);
+            longCounts.clear();
+        }
+
+        void add(size_t length) {
+            if (!counting) {
+                return;
+            }
+            if (length < kShortLengths) {
+                shortCounts[length]++;
+            } else {
+                longCounts[length]++;
+            }
+            longestLength = std::max(longestLength, length);
+        }
+
+        void remove(size_t length) {
+            if (!counting) {
+                return;
+            }
+            if (length < kShortLengths) {
+                shortCounts[length]--;
+            } else {
+                std::map<size_t, size_t>::iterator it = longCounts.find(length);
+                if (--it->second == 0) {
+                    longCounts.erase(it);
+                }
+            }
+            if (length == longestLength) {
+                findLongest();
+            }
+        }
+
+        size_t longest() const {
+            return longestLength;
+        }
+
+    private:
+        enum { kShortLengths = 1024 };
+
+        bool counting;
+        size_t longestLength;
+        std::vector<size_t> shortCounts;
+        std::map<size_t, size_t> longCounts;
+
+        // Bounded by the table size, since longer lengths come straight from the map.
+        void findLongest() {
+            if (!longCounts.empty()) {
+                longestLength = longCounts.rbegin()->first;
+                return;
+            }
+            size_t length = std::min(longestLength, static_cast<size_t>(kShortLengths) - 1);
+            while (length > 0 && shortCounts[length] == 0) {
+                length--;
+            }
+            longestLength = length;
+        }
+    };
+
+    // Open-addressing table used while interning; entries point at canonical line bytes.
+    class InternTable {
+    public:
+        explicit InternTable(size_t lines) : mask(1) {
+            while (mask < lines * 2) {
+                mask <<= 1;
+            }
+            entries.resize(mask);
+            mask--;
+        }
+
+        // Returns the canonical pointer for the text; a null result is a new entry the
+        // caller fills in with the bytes it keeps.
+        const char*& lookup(const char* text, size_t length) {
+            unsigned long long hash = hashBytes(text, length);
+            for (size_t i = hash & mask; ; i = (i + 1) & mask) {
+                Entry& entry = entries[i];
+                if (!entry.data) {
+                    entry.hash = hash;
+                    entry.length = length;
+                    return entry.data;
+                }
+                if (entry.hash == hash && entry.length == length && memcmp(entry.data, text, length) == 0) {
+                    return entry.data;
+                }
+            }
+        }
+
+        static unsigned long long hashBytes(const char* text, size_t length) {
+            unsigned long long hash = 0x9E3779B97F4A7C15ULL ^ length;
+            size_t i = 0;
+            for (; i + 8 <= length; i += 8) {
+                unsigned long long word;
+                memcpy(&word, text + i, 8);
+                hash = (hash ^ word) * 0xFF51AFD7ED558CCDULL;
+                hash ^= hash >> 32;
+            }
+            for (; i < length; i++) {
+                hash = (hash ^ static_cast<unsigned char>(text[i])) * 0x100000001B3ULL;
+            }
+            return hash ^ (hash >> 29);
+        }
+
+    private:
+        struct Entry {
+            Entry() : hash(0), data(nullptr), length(0) {}
+
+            unsigned long long hash;
+            const char* data;
+            size_t length;
+        };
+
+        std::vector<Entry> entries;
+        size_t mask;
+    };
+
+    std::vector<LineSlot> slots;
+    std::vector<std::shared_ptr<Arena>> arenas;
+    size_t liveBytes;
+    size_t sharedLines;
+    size_t wordCount;
+    size_t charCount;
+    LineLengthCounts lineLengths;
+
+    void countLine(const char* text, size_t length) {
+        countText(text, length, wordCount, charCount);
+        lineLengths.add(length);
+    }
+
+    void uncountLine(size_t index) {
+        size_t words = 0, chars = 0;
+        countText(slots[index].data, slots[index].length, words, chars);
+        wordCount -= words;
+        charCount -= chars;
+        lineLengths.remove(slots[index].length);
+    }
+
+    // Adds the words and UTF-8 characters of text that follows whitespace. Words are split
+    // on the ASCII whitespace isspace() accepts; a character is any byte that does not
+    // continue a multi-byte sequence. Whole 8-byte words are classified with SWAR bit tricks.
+    static void countText(const char* text, size_t length, size_t& words, size_t& chars) {
+        size_t i = 0;
+        bool previousSpace = true;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+        const unsigned long long ones = 0x0101010101010101ULL;
+        const unsigned long long high = 0x8080808080808080ULL;
+        const unsigned long long low = ~high;
+        unsigned long long carry = 0x80;
+        for (; i + 8 <= length; i += 8) {
+            unsigned long long x;
+            memcpy(&x, text + i, 8);
+            // High bit of each byte: equal to ' ', or an ASCII byte in '\t'..'\r'.
+            unsigned long long y = x ^ (ones * ' ');
+            unsigned long long blank = ~(((y & low) + low) | y | low);
+            unsigned long long control = ((x | high) - ones * 9) & ~((x | high) - ones * 14) & ~x & high;
+            unsigned long long space = blank | control;
+            unsigned long long starts = ~space & ((space << 8) | carry) & high;
+            // Each flag is one high bit, so multiplying by ones sums them into the top byte.
+            words += ((starts >> 7) * ones) >> 56;
+            chars += 8 - ((((x & ~(x << 1) & high) >> 7) * ones) >> 56);
+            carry = (space >> 56) & 0x80;
+        }
+        previousSpace = carry != 0;
+#endif
+        for (; i < length; i++) {
+            unsigned char c = static_cast<unsigned char>(text[i]);
+            bool space = c == ' ' || (c >= '\t' && c <= '\r');
+            if (!space && previousSpace) {
+                words++;
+            }
+            previousSpace = space;
+            if ((c & 0xC0) != 0x80) {
+                chars++;
+            }
+        }
+    }
+
+    // Estimates the bytes held by repeated lines from the distinct lines whose hash falls
+    // in one kDuplicateSampling-th of the hash space: scaled up, their bytes estimate the
+    // distinct text, and the rest of the live bytes are repeats. Identical lines hash alike,
+    // so few distinct lines leave the slice nearly empty and the estimate near liveBytes.
+    // indexLines hashes the lines and picks the sample while they are still in cache, on its
+    // worker threads; this only sorts and compares the sampled sixteenth.
+    size_t estimateDuplicateBytes(std::vector<std::pair<unsigned long long, size_t>>& sample) const {
+        std::sort(sample.begin(), sample.end());
+        size_t distinctBytes = 0;
+        for (size_t k = 0; k < sample.size(); k++) {
+            const LineSlot& slot = slots[sample[k].second];
+            if (k > 0) {
+                const LineSlot& previous = slots[sample[k - 1].second];
+                if (sample[k].first == sample[k - 1].first && slot.length == previous.length &&
+                    memcmp(slot.data, previous.data, slot.length) == 0) {
+                    continue;
+                }
+            }
+            distinctBytes += slot.length;
+        }
+        return liveBytes - std::min(liveBytes, distinctBytes * kDuplicateSampling);
+    }
+
+    // Copies every distinct line once into a fresh arena and points identical lines at the
+    // same bytes. Shared bytes are never written again: editing a line stores a new copy.
+    void rebuildInterned(size_t reserveBytes) {
+        std::vector<std::shared_ptr<Arena>> oldArenas;
+        oldArenas.swap(arenas);
+        reserveArena(reserveBytes);
+
+        InternTable table(slots.size());
+        sharedLines = 0;
+        for (size_t i = 0; i < slots.size(); i++) {
+            LineSlot& slot = slots[i];
+            if (slot.length == 0) {
+                continue;
+            }
+            const char*& canonical = table.lookup(slot.data, slot.length);
+            if (canonical) {
+                slot.data = canonical;
+                sharedLines++;
+                continue;
+            }
+
+            liveBytes -= slot.length;
+            slot = store(slot.data, slot.length);
+            canonical = slot.data;
+        }
+    }
+
+    void reserveArena(size_t bytes) {
+        arenas.push_back(std::make_shared<Arena>(std::max<size_t>(bytes, kArenaSize)));
+    }
+
+    LineSlot store(const char* text, size_t length) {
+        LineSlot slot = {"", length};
+        liveBytes += length;
+        if (length == 0) {
+            return slot;
+        }
+
+        if (arenas.empty() || arenas.back()->capacity - arenas.back()->used < length) {
+            reserveArena(length);
+        }
+        Arena& arena = *arenas.back();
+        char* target = &arena.bytes[arena.used];
+        memcpy(target, text, length);
+        arena.used += length;
+        slot.data = target;
+        return slot;
+    }
+
+    // Also adds the words and characters of the image, counting every newline as a character,
+    // and collects the hashed sample of non-empty lines for estimateDuplicateBytes.
+    static size_t indexLines(const char* data, size_t size, std::vector<LineSlot>& lines, size_t& words, size_t& chars,
+                             std::vector<std::pair<unsigned long long, size_t>>& sample) {
+        const size_t parallelThreshold = 8 << 20;
+        size_t workerCount = size >= parallelThreshold ? std::max(1u, std::thread::hardware_concurrency()) : 1;
+        std::vector<std::vector<LineSlot>> parts(workerCount);
+        std::vector<size_t> partBytes(workerCount, 0);
+        std::vector<size_t> partWords(workerCount, 0);
+        std::vector<size_t> partChars(workerCount, 0);
+        std::vector<std::vector<std::pair<unsigned long long, size_t>>> partSamples(workerCount);
+
+        std::vector<std::thread> workers;
+        for (size_t w = 0; w < workerCount; w++) {
+            std::function<void()> task = [&, w]() {
+                TraceSpan span("ArenaLineStore::indexLines");
+                size_t begin = size * w / workerCount;
+                size_t end = size * (w + 1) / workerCount;
+                if (begin > 0) {
+                    const char* newline = static_cast<const char*>(memchr(data + begin - 1, '\n', size - begin + 1));
+                    begin = newline ? static_cast<size_t>(newline - data) + 1 : size;
+                }
+
+                size_t first = begin;
+                while (begin < end) {
+                    const char* newline = static_cast<const char*>(memchr(data + begin, '\n', size - begin));
+                    size_t lineEnd = newline ? static_cast<size_t>(newline - data) : size;
+                    LineSlot slot = {lineEnd > begin ? data + begin : "", lineEnd - begin};
+                    if (slot.length > 0) {
+                        unsigned long long hash = InternTable::hashBytes(slot.data, slot.length);
+                        if (hash % kDuplicateSampling == 0) {
+                            partSamples[w].push_back(std::make_pair(hash, parts[w].size()));
+                        }
+                    }
+                    parts[w].push_back(slot);
+                    partBytes[w] += slot.length;
+                    begin = lineEnd + 1;
+                }
+                if (first < begin) {
+                    countText(data + first, std::min(begin, size) - first, partWords[w], partChars[w]);
+                }
+            };
+            if (workerCount == 1) {
+                task();
+            } else {
+                workers.push_back(std::thread(task));
+            }
+        }
+        for (size_t w = 0; w < workers.size(); w++) {
+            workers[w].join();
+        }
+
+        size_t total = 0, bytes = 0;
+        for (size_t w = 0; w < workerCount; w++) {
+            total += parts[w].size();
+            bytes += partBytes[w];
+            words += partWords[w];
+            chars += partChars[w];
+        }
+        lines.reserve(total);
+        for (size_t w = 0; w < workerCount; w++) {
+            for (size_t k = 0; k < partSamples[w].size(); k++) {
+                sample.push_back(std::make_pair(partSamples[w][k].first, lines.size() + partSamples[w][k].second));
+            }
+            lines.insert(lines.end(), parts[w].begin(), parts[w].end());
+        }
+        return bytes;
+    }
+};
+
+// Immutable view of the document at one revision. It holds line descriptors into the
+// store's arenas, which it pins, rather than copies of the text. Descriptors are grouped
+// into chunks shared between versions, so publishing a version only copies the chunks
+// edited since the last.
+class DocumentVersion {
+public:
+    enum { kChunkLines = 1024 };
+
+    DocumentVersion() : revision(0), lineCount(0) {}
+
+    unsigned long long getRevision() const {
+        return revision;
+    }
+
+    size_t getLineCount() const {
+        return lineCount;
+    }
+
+    const char* data(size_t index) const {
+        return (*chunks[index / kChunkLines])[index % kChunkLines].data;
+    }
+
+    size_t length(size_t index) const {
+        return (*chunks[index / kChunkLines])[index % kChunkLines].length;
+    }
+
+    const std::string& fetch(size_t index, std::string& scratch) const {
+        scratch.assign(data(index), length(index));
+        return scratch;
+    }
+
+private:
+    friend class StringArray;
+
+    struct LineRef {
+        const char* data;
+        size_t length;
+    };
+
+    unsigned long long revision;
+    size_t lineCount;
+    std::vector<std::shared_ptr<const std::vector<LineRef>>> chunks;
+    std::vector<std::shared_ptr<const void>> arenas;
+};
+
+// Compact binary log of editing operations, for replaying real sessions. The file starts
+// with "HMTR" and a version byte; each record is an opcode byte, the microseconds since the
+// previous record and the operation's arguments. Integers are LEB128 varints, zigzag
+// encoded, and strings are a varint length followed by the bytes. Version 2 added the line
+// count and checksum of the loaded text to load records.
+class EditTrace {
+public:
+    enum Op {
+        kAppend = 1, kEmptyLine, kReplaceLines, kDelete, kUndo, kRedo, kInsert, kCut, kCopy, kPaste,
+        kSplitLine, kJoinLines, kLoad, kSearch, kRegexSearch, kErase, kBeginGroup, kEndGroup, kOpCount
+    };
+
+    enum { kVersion = 2 };
+
+    EditTrace() : last(std::chrono::steady_clock::now()) {}
+
+    bool open(const std::string& fileName) {
+        output.open(fileName, std::ios::binary | std::ios::trunc);
+        if (!output.is_open()) {
+            return false;
+        }
+        output.write("HMTR", 4);
+        output.put(static_cast<char>(kVersion));
+        output.flush();
+        return true;
+    }
+
+    bool isOpen() const {
+        return output.is_open();
+    }
+
+    EditTrace& begin(Op op) {
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        record.clear();
+        record += static_cast<char>(op);
+        appendVarint(std::chrono::duration_cast<std::chrono::microseconds>(now - last).count());
+        last = now;
+        return *this;
+    }
+
+    EditTrace& integer(long long value) {
+        appendVarint((static_cast<unsigned long long>(value) << 1) ^ static_cast<unsigned long long>(value >> 63));
+        return *this;
+    }
+
+    EditTrace& text(const std::string& value) {
+        appendVarint(value.size());
+        record += value;
+        return *this;
+    }
+
+    // Writes the record straight away; the command loop only ends when the process is killed.
+    void end() {
+        output.write(record.data(), record.size());
+        output.flush();
+    }
+
+    static const char* opName(int op) {
+        static const char* const names[] = {
+            "", "append", "emptyLine", "replaceLines", "delete", "undo", "redo", "insert", "cut", "copy",
+            "paste", "splitLine", "joinLines", "load", "search", "regexSearch", "erase", "beginGroup", "endGroup"
+        };
+        return op > 0 && op < kOpCount ? names[op] : "unknown";
+    }
+
+private:
+    std::ofstream output;
+    std::string record;
+    std::chrono::steady_clock::time_point last;
+
+    void appendVarint(unsigned long long value) {
+        while (value >= 0x80) {
+            record += static_cast<char>((value & 0x7F) | 0x80);
+            value >>= 7;
+        }
+        record += static_cast<char>(value);
+    }
+};
+
+// Reads the records written by EditTrace. The caller knows each operation's arguments and
+// reads them in the order they were written.
+class EditTraceReader {
+public:
+    explicit EditTraceReader(const std::string& fileName) : input(fileName, std::ios::binary), version(0) {
+        char header[5];
+        if (!input.read(header, sizeof(header)) || memcmp(header, "HMTR", 4) != 0 ||
+            header[4] < 1 || header[4] > EditTrace::kVersion) {
+            throw std::runtime_error("Not an edit trace: " + fileName);
+        }
+        version = header[4];
+    }
+
+    int getVersion() const {
+        return version;
+    }
+
+    // Returns false at the end of the trace.
+    bool next(int& op, unsigned long long& micros) {
+        int byte = input.get();
+        if (byte == EOF) {
+            return false;
+        }
+        op = byte;
+        micros = readVarint();
+        return true;
+    }
+
+    long long integer() {
+        unsigned long long value = readVarint();
+        return static_cast<long long>(value >> 1) ^ -static_cast<long long>(value & 1);
+    }
+
+    std::string text() {
+        std::string value(static_cast<size_t>(readVarint()), '\0');
+        if (!value.empty() && !input.read(&value[0], value.size())) {
+            throw std::runtime_error("Truncated edit trace.");
+        }
+        return value;
+    }
+
+private:
+    std::ifstream input;
+    int version;
+
+    unsigned long long readVarint() {
+        unsigned long long value = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+            int byte = input.get();
+            if (byte == EOF) {
+                throw std::runtime_error("Truncated edit trace.");
+            }
+            value |= static_cast<unsigned long long>(byte & 0x7F) << shift;
+            if (!(byte & 0x80)) {
+                return value;
+            }
+        }
+        throw std::runtime_error("Corrupt edit trace.");
+    }
+};
+
+// Byte layout of the file the document was last loaded from or saved to, and the identity
+// and modification time it had then.
+struct SavedLayout {
+    SavedLayout() : revision(0), fileSize(-1), device(0), inode(0), modifiedNanoseconds(0), recordedNanoseconds(0) {}
+
+    std::string fileName;
+    unsigned long long revision;
+    std::vector<unsigned long long> lineOffsets;
+    long long fileSize;
+    unsigned long long device;
+    unsigned long long inode;
+    long long modifiedNanoseconds;
+    long long recordedNanoseconds;
+
+    void record(const struct stat& info) {
+        fileSize = info.st_size;
+        device = info.st_dev;
+        inode = info.st_ino;
+        modifiedNanoseconds = modifiedTimeOf(info);
+        recordedNanoseconds = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+    }
+
+    // True when the file is provably the one recorded. On file systems with whole-second
+    // timestamps, a write later in the second the file was recorded would keep its time,
+    // so that case never matches.
+    bool matches(const struct stat& info) const {
+        const long long second = 1000000000LL;
+        if (fileSize < 0 || info.st_size != fileSize || static_cast<unsigned long long>(info.st_dev) != device ||
+            static_cast<unsigned long long>(info.st_ino) != inode || modifiedTimeOf(info) != modifiedNanoseconds) {
+            return false;
+        }
+        return modifiedNanoseconds % second != 0 || recordedNanoseconds / second > modifiedNanoseconds / second;
+    }
+
+    static long long modifiedTimeOf(const struct stat& info) {
+#ifdef __APPLE__
+        return info.st_mtimespec.tv_sec * 1000000000LL + info.st_mtimespec.tv_nsec;
+#else
+        return info.st_mtim.tv_sec * 1000000000LL + info.st_mtim.tv_nsec;
+#endif
+    }
+};
+
+// Undo and redo stacks whose oldest entries can be inspected and dropped.
+class EditHistory : public std::stack<ArenaLineStore> {
+public:
+    const container_type& entries() const {
+        return c;
+    }
+
+    size_t dropOldest(size_t count) {
+        count = std::min(count, c.size());
+        c.erase(c.begin(), c.begin() + count);
+        return count;
+    }
+};
+
+// Fenwick tree over line lengths, each counted with its newline as saved, so byte offsets
+// and (line, column) positions convert in O(log n). Changing a line, appending one or erasing
+// the last one is O(log n); inserting or erasing a line elsewhere shifts every later entry,
+// which is O(n) in the line store too, so it only marks the tree stale for the next query.
+class LineOffsetIndex {
+public:
+    LineOffsetIndex() : stale(true) {}
+
+    void invalidate() {
+        stale = true;
+    }
+
+    void lineChanged(const ArenaLineStore& lines, size_t index) {
+        if (stale || tree.size() != lines.size()) {
+            stale = true;
+            return;
+        }
+        // Unsigned wraparound turns a shorter line into a subtraction.
+        add(index, lines.length(index) + 1 - (prefix(index + 1) - prefix(index)));
+    }
+
+    // Node i covers the lines (i - lowbit(i), i], so a new last node sums the ones before it.
+    void lineAppended(const ArenaLineStore& lines) {
+        if (stale || tree.size() + 1 != lines.size()) {
+            stale = true;
+            return;
+        }
+        size_t count = lines.size();
+        tree.push_back(lines.length(count - 1) + 1 + prefix(count - 1) - prefix(count - (count & (~count + 1))));
+    }
+
+    // No node covers a line after itself, so dropping the last line drops the last node.
+    void lastLineErased(const ArenaLineStore& lines) {
+        if (stale || tree.size() != lines.size() + 1) {
+            stale = true;
+            return;
+        }
+        tree.pop_back();
+    }
+
+    // Offset of the first byte of the 0-based line; the line count gives the document size.
+    size_t lineStart(const ArenaLineStore& lines, size_t index) {
+        refresh(lines);
+        return prefix(index);
+    }
+
+    // Finds the 0-based line holding the offset; the column may point at its newline.
+    bool locate(const ArenaLineStore& lines, size_t offset, size_t& index, size_t& column) {
+        refresh(lines);
+        size_t step = 1;
+        while (step * 2 <= tree.size()) {
+            step *= 2;
+        }
+        size_t position = 0;
+        size_t remaining = offset;
+        for (; step > 0; step /= 2) {
+            if (position + step <= tree.size() && tree[position + step - 1] <= remaining) {
+                position += step;
+                remaining -= tree[position - 1];
+            }
+        }
+        if (position >= tree.size()) {
+            return false;
+        }
+        index = position;
+        column = remaining;
+        return true;
+    }
+
+    size_t memoryBytes() const {
+        return tree.capacity() * sizeof(size_t);
+    }
+
+private:
+    std::vector<size_t> tree;
+    bool stale;
+
+    void refresh(const ArenaLineStore& lines) {
+        if (!stale && tree.size() == lines.size()) {
+            return;
+        }
+        tree.resize(lines.size());
+        for (size_t i = 0; i < tree.size(); i++) {
+            tree[i] = lines.length(i) + 1;
+        }
+        for (size_t i = 1; i <= tree.size(); i++) {
+            size_t parent = i + (i & (~i + 1));
+            if (parent <= tree.size()) {
+                tree[parent - 1] += tree[i - 1];
+            }
+        }
+        stale = false;
+    }
+
+    size_t prefix(size_t count) const {
+        size_t sum = 0;
+        for (; count > 0; count &= count - 1) {
+            sum += tree[count - 1];
+        }
+        return sum;
+    }
+
+    void add(size_t index, size_t delta) {
+        for (size_t i = index + 1; i <= tree.size(); i += i & (~i + 1)) {
+            tree[i - 1] += delta;
+        }
+    }
+};
+
+// Undo histories for StringArray. An edit reports each line change before it is
+// applied to the store and then commits them as one undo step. Undo and redo report the
+// lines they changed, or that the line structure changed, so the caller can invalidate caches.
+
+// Keeps a copy of the line table after every edit. Copies share the arenas, so a step costs
+// one descriptor per line: cheap undo, but O(lines) per edit.
+class SnapshotHistory {
+public:
+    explicit SnapshotHistory(const ArenaLineStore& initial) {
+        undoStack.push(initial);
+    }
+
+    void lineSet(const ArenaLineStore&, size_t, const std::string&) {}
+
+    void lineInserted(size_t, const std::string&) {}
+
+    void lineErased(const ArenaLineStore&, size_t) {}
+
+    void replacedAll(const ArenaLineStore& array) {
+        undoStack = EditHistory();
+        redoStack = EditHistory();
+        undoStack.push(array);
+    }
+
+    void commit(const ArenaLineStore& array) {
+        undoStack.push(array);
+        redoStack = EditHistory();
+    }
+
+    bool undo(ArenaLineStore& array, std::vector<size_t>&, bool& structural) {
+        if (undoStack.size() <= 1) {
+            return false;
+        }
+        redoStack.push(array);
+        undoStack.pop();
+        array = undoStack.top();
+        structural = true;
+        return true;
+    }
+
+    bool redo(ArenaLineStore& array, std::vector<size_t>&, bool& structural) {
+        if (redoStack.empty()) {
+            return false;
+        }
+        array = redoStack.top();
+        undoStack.push(array);
+        redoStack.pop();
+        structural = true;
+        return true;
+    }
+
+    size_t size() const {
+        return undoStack.size();
+    }
+
+    // Forgets the oldest steps, always keeping the most recent one.
+    size_t trim(size_t count) {
+        return undoStack.dropOldest(std::min(count, undoStack.size() - 1));
+    }
+
+    size_t undoBytes(std::unordered_set<const void*>& seen) const {
+        return stackBytes(undoStack, seen);
+    }
+
+    const EditHistory& undoStates() const {
+        return undoStack;
+    }
+
+    size_t redoBytes(std::unordered_set<const void*>& seen) const {
+        return stackBytes(redoStack, seen);
+    }
+
+private:
+    EditHistory undoStack;
+    EditHistory redoStack;
+
+    static size_t stackBytes(const EditHistory& stack, std::unordered_set<const void*>& seen) {
+        size_t total = 0;
+        for (size_t i = 0; i < stack.entries().size(); i++) {
+            const ArenaLineStore& entry = stack.entries()[i];
+            total += sizeof(ArenaLineStore) + entry.getDescriptorBytes() + entry.countNewArenaBytes(seen);
+        }
+        return total;
+    }
+};
+
+// Keeps only the changed lines of every edit, so an edit costs O(changed text) whatever the
+// document size. Loading new contents clears it, since its steps address lines by index.
+class DeltaHistory {
+public:
+    explicit DeltaHistory(const ArenaLineStore&) {}
+
+    void lineSet(const ArenaLineStore& array, size_t index, const std::string& text) {
+        pending.push_back(LineChange(LineChange::kSet, index, array.line(index), text));
+    }
+
+    void lineInserted(size_t index, const std::string& text) {
+        pending.push_back(LineChange(LineChange::kInsert, index, std::string(), text));
+    }
+
+    void lineErased(const ArenaLineStore& array, size_t index) {
+        pending.push_back(LineChange(LineChange::kErase, index, array.line(index), std::string()));
+    }
+
+    void replacedAll(const ArenaLineStore&) {
+        undoSteps.clear();
+        redoSteps.clear();
+        pending.clear();
+    }
+
+    void commit(const ArenaLineStore&) {
+        if (pending.empty()) {
+            return;
+        }
+        undoSteps.push_back(Step());
+        undoSteps.back().swap(pending);
+        redoSteps.clear();
+    }
+
+    bool undo(ArenaLineStore& array, std::vector<size_t>& changedLines, bool& structural) {
+        if (undoSteps.empty()) {
+            return false;
+        }
+        const Step& step = undoSteps.back();
+        for (size_t i = step.size(); i-- > 0; ) {
+            const LineChange& change = step[i];
+            if (change.kind == LineChange::kSet) {
+                array.setLine(change.index, change.before);
+                changedLines.push_back(change.index);
+            } else if (change.kind == LineChange::kInsert) {
+                array.eraseLine(change.index);
+                structural = true;
+            } else {
+                array.insertLine(change.index, change.before);
+                structural = true;
+            }
+        }
+        redoSteps.push_back(Step());
+        redoSteps.back().swap(undoSteps.back());
+        undoSteps.pop_back();
+        return true;
+    }
+
+    bool redo(ArenaLineStore& array, std::vector<size_t>& changedLines, bool& structural) {
+        if (redoSteps.empty()) {
+            return false;
+        }
+        const Step& step = redoSteps.back();
+        for (size_t i = 0; i < step.size(); i++) {
+            const LineChange& change = step[i];
+            if (change.kind == LineChange::kSet) {
+                array.setLine(change.index, change.after);
+                changedLines.push_back(change.index);
+            } else if (change.kind == LineChange::kInsert) {
+                array.insertLine(change.index, change.after);
+                structural = true;
+            } else {
+                array.eraseLine(change.index);
+                structural = true;
+            }
+        }
+        undoSteps.push_back(Step());
+        undoSteps.back().swap(redoSteps.back());
+        redoSteps.pop_back();
+        return true;
+    }
+
+    size_t size() const {
+        return undoSteps.size();
+    }
+
+    size_t trim(size_t count) {
+        count = undoSteps.empty() ? 0 : std::min(count, undoSteps.size() - 1);
+        undoSteps.erase(undoSteps.begin(), undoSteps.begin() + count);
+        return count;
+    }
+
+    // Replaces the history with the steps between consecutive snapshots, oldest first. Each
+    // step rewrites the lines between the two snapshots' common prefix and suffix.
+    void adoptSnapshots(const EditHistory& states) {
+        replacedAll(ArenaLineStore());
+        for (size_t i = 1; i < states.entries().size(); i++) {
+            undoSteps.push_back(Step());
+            addDifference(states.entries()[i - 1], states.entries()[i], undoSteps.back());
+        }
+    }
+
+    size_t undoBytes(std::unordered_set<const void*>&) const {
+        size_t total = 0;
+        for (size_t i = 0; i < undoSteps.size(); i++) {
+            total += stepBytes(undoSteps[i]);
+        }
+        return total;
+    }
+
+    size_t redoBytes(std::unordered_set<const void*>&) const {
+        size_t total = 0;
+        for (size_t i = 0; i < redoSteps.size(); i++) {
+            total += stepBytes(redoSteps[i]);
+        }
+        return total;
+    }
+
+private:
+    struct LineChange {
+        enum Kind { kSet, kInsert, kErase };
+
+        LineChange(Kind kind, size_t index, const std::string& before, const std::string& after)
+            : kind(kind), index(index), before(before), after(after) {}
+
+        Kind kind;
+        size_t index;
+        std::string before;
+        std::string after;
+    };
+
+    typedef std::vector<LineChange> Step;
+
+    std::deque<Step> undoSteps;
+    std::vector<Step> redoSteps;
+    Step pending;
+
+    // Unchanged lines usually share their bytes, so the pointer test settles most of them.
+    static bool sameLine(const ArenaLineStore& a, size_t i, const ArenaLineStore& b, size_t j) {
+        return a.length(i) == b.length(j) && (a.data(i) == b.data(j) || memcmp(a.data(i), b.data(j), a.length(i)) == 0);
+    }
+
+    static void addDifference(const ArenaLineStore& before, const ArenaLineStore& after, Step& step) {
+        size_t prefix = 0;
+        size_t common = std::min(before.size(), after.size());
+        while (prefix < common && sameLine(before, prefix, after, prefix)) {
+            prefix++;
+        }
+        size_t suffix = 0;
+        while (suffix < common - prefix && sameLine(before, before.size() - 1 - suffix, after, after.size() - 1 - suffix)) {
+            suffix++;
+        }
+
+        size_t removed = before.size() - prefix - suffix;
+        size_t added = after.size() - prefix - suffix;
+        for (size_t i = 0; i < std::min(removed, added); i++) {
+            step.push_back(LineChange(LineChange::kSet, prefix + i, before.line(prefix + i), after.line(prefix + i)));
+        }
+        for (size_t i = added; i < removed; i++) {
+            step.push_back(LineChange(LineChange::kErase, prefix + added, before.line(prefix + i), std::string()));
+        }
+        for (size_t i = removed; i < added; i++) {
+            step.push_back(LineChange(LineChange::kInsert, prefix + i, std::string(), after.line(prefix + i)));
+        }
+    }
+
+    static size_t stepBytes(const Step& step) {
+        size_t total = sizeof(Step) + step.capacity() * sizeof(LineChange);
+        for (size_t i = 0; i < step.size(); i++) {
+            total += step[i].before.capacity() + step[i].after.capacity();
+        }
+        return total;
+    }
+};
+
+// The editor's history: snapshots while the document is small and deltas once it is large.
+// Loading decides afresh; an edit that takes the document past the threshold turns the
+// snapshots into delta steps and keeps recording deltas until the next load.
+class AdaptiveHistory {
+public:
+    enum { kLargeDocumentBytes = 16 << 20 };
+
+    explicit AdaptiveHistory(const ArenaLineStore& initial) : snapshots(initial), deltas(initial), large(false) {}
+
+    void lineSet(const ArenaLineStore& array, size_t index, const std::string& text) {
+        if (large) {
+            deltas.lineSet(array, index, text);
+        }
+    }
+
+    void lineInserted(size_t index, const std::string& text) {
+        if (large) {
+            deltas.lineInserted(index, text);
+        }
+    }
+
+    void lineErased(const ArenaLineStore& array, size_t index) {
+        if (large) {
+            deltas.lineErased(array, index);
+        }
+    }
+
+    void replacedAll(const ArenaLineStore& array) {
+        large = isLargeDocument(array);
+        snapshots.replacedAll(large ? ArenaLineStore() : array);
+        deltas.replacedAll(array);
+    }
+
+    // A commit clears the redo side, so only the undo snapshots need converting.
+    void commit(const ArenaLineStore& array) {
+        if (large) {
+            deltas.commit(array);
+            return;
+        }
+        snapshots.commit(array);
+        if (isLargeDocument(array)) {
+            deltas.adoptSnapshots(snapshots.undoStates());
+            snapshots.replacedAll(ArenaLineStore());
+            large = true;
+        }
+    }
+
+    bool undo(ArenaLineStore& array, std::vector<size_t>& changedLines, bool& structural) {
+        return large ? deltas.undo(array, changedLines, structural) : snapshots.undo(array, changedLines, structural);
+    }
+
+    bool redo(ArenaLineStore& array, std::vector<size_t>& changedLines, bool& structural) {
+        return large ? deltas.redo(array, changedLines, structural) : snapshots.redo(array, changedLines, structural);
+    }
+
+    size_t size() const {
+        return large ? deltas.size() : snapshots.size();
+    }
+
+    size_t trim(size_t count) {
+        return large ? deltas.trim(count) : snapshots.trim(count);
+    }
+
+    size_t undoBytes(std::unordered_set<const void*>& seen) const {
+        return large ? deltas.undoBytes(seen) : snapshots.undoBytes(seen);
+    }
+
+    size_t redoBytes(std::unordered_set<const void*>& seen) const {
+        return large ? deltas.redoBytes(seen) : snapshots.redoBytes(seen);
+    }
+
+private:
+    SnapshotHistory snapshots;
+    DeltaHistory deltas;
+    bool large;
+
+    static bool isLargeDocument(const ArenaLineStore& array) {
+        return array.getLiveBytes() + array.size() >= static_cast<size_t>(kLargeDocumentBytes);
+    }
+};
+
+// The editor's document, used by every front end: line storage, revision tracking for caches
+// and snapshots, and undo history. AdaptiveHistory picks snapshots or deltas at runtime from
+// the document's size.
+class StringArray {
+public:
+    // One entry of the edit log: a changed line, or a line inserted or erased at index,
+    // which shifts every later line. Indices are as of the edit.
+    struct LineEdit {
+        enum Kind { kChanged, kInserted, kErased };
+
+        unsigned long long revision;
+        size_t index;
+        Kind kind;
+    };
+
+private:
+    ArenaLineStore array;
+    AdaptiveHistory history;
+    int consecutiveUndoCount;
+    std::string clipboard;
+    std::vector<unsigned long long> lineVersions;
+    std::vector<LineEdit> changeLog;
+    unsigned long long revision;
+    unsigned long long structureRevision;
+    std::shared_ptr<const DocumentVersion> publishedVersion;
+    SavedLayout savedLayout;
+    EditTrace* trace;
+    LineOffsetIndex offsets;
+    bool editGroupOpen;
+    bool editGroupChanged;
+
+    void recordFileState() {
+        struct stat info;
+        if (stat(savedLayout.fileName.c_str(), &info) == 0) {
+            savedLayout.record(info);
+        } else {
+            savedLayout.fileSize = -1;
+        }
+    }
+
+    void touchLine(size_t index) {
+        if (lineVersions.size() < array.size()) {
+            lineVersions.resize(array.size(), revision);
+        }
+        lineVersions[index] = ++revision;
+        offsets.lineChanged(array, index);
+        logEdit(index, LineEdit::kChanged);
+    }
+
+    // Records a line inserted or erased at index; the lines around it keep their versions.
+    void touchShiftedLines(size_t index, typename LineEdit::Kind kind) {
+        ++revision;
+        if (kind == LineEdit::kInserted) {
+            lineVersions.insert(lineVersions.begin() + std::min(index, lineVersions.size()), revision);
+        } else if (index < lineVersions.size()) {
+            lineVersions.erase(lineVersions.begin() + index);
+        }
+        logEdit(index, kind);
+    }
+
+    void logEdit(size_t index, typename LineEdit::Kind kind) {
+        if (changeLog.size() >= array.size() + 64) {
+            structureRevision = revision;
+            changeLog.clear();
+            return;
+        }
+        LineEdit edit = {revision, index, kind};
+        changeLog.push_back(edit);
+    }
+
+    static bool editedAfter(unsigned long long since, const LineEdit& edit) {
+        return since < edit.revision;
+    }
+
+    // Used when the whole array is swapped out, which invalidates every cached line.
+    void touchAllLines() {
+        offsets.invalidate();
+        structureRevision = ++revision;
+        lineVersions.assign(array.size(), revision);
+        changeLog.clear();
+    }
+
+    void setLine(size_t index, const std::string& text) {
+        history.lineSet(array, index, text);
+        array.setLine(index, text);
+    }
+
+    void insertLine(size_t index, const std::string& text) {
+        history.lineInserted(index, text);
+        array.insertLine(index, text);
+        if (index + 1 == array.size()) {
+            offsets.lineAppended(array);
+        } else {
+            offsets.invalidate();
+        }
+    }
+
+    void eraseLine(size_t index) {
+        history.lineErased(array, index);
+        array.eraseLine(index);
+        if (index == array.size()) {
+            offsets.lastLineErased(array);
+        } else {
+            offsets.invalidate();
+        }
+    }
+
+    // Closes the line changes made so far as one undo step, or adds them to the open group.
+    void commitEdit() {
+        consecutiveUndoCount = 0;
+        if (editGroupOpen) {
+            editGroupChanged = true;
+            return;
+        }
+        history.commit(array);
+    }
+
+    bool eraseRange(int lineIndex, int position, int length, std::string* removed) {
+        if (lineIndex < 1 || static_cast<size_t>(lineIndex) > array.size()) {
+            std::cerr << "Invalid line index." << std::endl;
+            return false;
+        }
+
+        std::string line = array.line(lineIndex - 1);
+
+        if (position < 0 || static_cast<size_t>(position) >= line.length()) {
+            std::cerr << "Invalid position." << std::endl;
+            return false;
+        }
+
+        if (length < 0 || static_cast<size_t>(position + length) > line.length()) {
+            std::cerr << "Invalid length." << std::endl;
+            return false;
+        }
+
+        if (removed) {
+            *removed = line.substr(position, length);
+        }
+        line.erase(position, length);
+        setLine(lineIndex - 1, line);
+        touchLine(lineIndex - 1);
+        commitEdit();
+        return true;
+    }
+
+    static bool keepsArenas(const std::vector<std::shared_ptr<const void>>& previous,
+                            const std::vector<std::shared_ptr<const void>>& current) {
+        std::unordered_set<const void*> held;
+        for (size_t i = 0; i < current.size(); i++) {
+            held.insert(current[i].get());
+        }
+        for (size_t i = 0; i < previous.size(); i++) {
+            if (!held.count(previous[i].get())) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void touchRestoredLines(const std::vector<size_t>& changedLines, bool structural) {
+        if (structural) {
+            touchAllLines();
+            return;
+        }
+        for (size_t i = 0; i < changedLines.size(); i++) {
+            touchLine(changedLines[i]);
+        }
+    }
+
+public:
+    struct MemoryUsage {
+        size_t array;
+        size_t history;
+        size_t redo;
+        size_t clipboard;
+
+        size_t total() const {
+            return array + history + redo + clipboard;
+        }
+    };
+
+    StringArray()
+        : history(array), consecutiveUndoCount(0), revision(0), structureRevision(0), trace(nullptr),
+          editGroupOpen(false), editGroupChanged(false) {}
+
+    // Estimates from container capacities. Arenas shared with the current text are charged
+    // to the array, and arenas shared between undo steps to the first step holding them.
+    MemoryUsage measureMemory() const {
+        std::unordered_set<const void*> seen;
+        MemoryUsage usage;
+        usage.array = array.getDescriptorBytes() + array.countNewArenaBytes(seen) + offsets.memoryBytes();
+        usage.history = history.undoBytes(seen);
+        usage.redo = history.redoBytes(seen);
+        usage.clipboard = clipboard.capacity();
+        return usage;
+    }
+
+    // Records every following edit into the trace; null stops recording.
+    void setTrace(EditTrace* editTrace) {
+        trace = editTrace;
+    }
+
+    size_t getHistorySize() const {
+        return history.size();
+    }
+
+    size_t getClipboardBytes() const {
+        return clipboard.capacity();
+    }
+
+    // Forgets the oldest undo steps, always keeping the most recent one.
+    size_t trimHistory(size_t count) {
+        return history.trim(count);
+    }
+
+    unsigned long long getRevision() const {
+        return revision;
+    }
+
+    // Publishes the current contents as an immutable version that worker threads can read
+    // while editing continues. Only called from the editing thread.
+    std::shared_ptr<const DocumentVersion> snapshot() {
+        std::shared_ptr<const DocumentVersion> previous = std::atomic_load(&publishedVersion);
+        if (previous && previous->revision == revision) {
+            return previous;
+        }
+
+        std::shared_ptr<DocumentVersion> next = std::make_shared<DocumentVersion>();
+        next->revision = revision;
+        next->lineCount = array.size();
+        array.pinArenas(next->arenas);
+        size_t chunkCount = (array.size() + DocumentVersion::kChunkLines - 1) / DocumentVersion::kChunkLines;
+
+        // Reused chunks point into the previous version's arenas, so they are only reused
+        // while the store still holds all of them, i.e. no compaction happened in between.
+        // Lines below the first insertion or erasure kept their numbers, so whole chunks of
+        // them can be reused unless one of their lines changed.
+        std::vector<char> dirty(chunkCount, 1);
+        std::vector<LineEdit> edits;
+        if (previous && keepsArenas(previous->arenas, next->arenas) && editsSince(previous->revision, edits)) {
+            size_t stableLines = std::min(previous->lineCount, array.size());
+            for (size_t i = 0; i < edits.size(); i++) {
+                if (edits[i].kind != LineEdit::kChanged) {
+                    stableLines = std::min(stableLines, edits[i].index);
+                }
+            }
+            size_t stableChunks = stableLines / DocumentVersion::kChunkLines;
+            std::fill(dirty.begin(), dirty.begin() + stableChunks, 0);
+            for (size_t i = 0; i < edits.size(); i++) {
+                if (edits[i].index < stableLines) {
+                    dirty[edits[i].index / DocumentVersion::kChunkLines] = 1;
+                }
+            }
+        }
+
+        next->chunks.reserve(chunkCount);
+        for (size_t c = 0; c < chunkCount; c++) {
+            if (!dirty[c]) {
+                next->chunks.push_back(previous->chunks[c]);
+                continue;
+            }
+            size_t first = c * DocumentVersion::kChunkLines;
+            size_t last = std::min(array.size(), first + DocumentVersion::kChunkLines);
+            std::shared_ptr<std::vector<DocumentVersion::LineRef>> chunk = std::make_shared<std::vector<DocumentVersion::LineRef>>();
+            chunk->reserve(last - first);
+            for (size_t i = first; i < last; i++) {
+                DocumentVersion::LineRef line = {array.data(i), array.length(i)};
+                chunk->push_back(line);
+            }
+            next->chunks.push_back(chunk);
+        }
+
+        std::shared_ptr<const DocumentVersion> published = next;
+        std::atomic_store(&publishedVersion, published);
+        return published;
+    }
+
+    // Records that fileName now holds exactly the current contents, one '\n' per line.
+    void markSaved(const std::string& fileName) {
+        array.compactIfFragmented();
+        savedLayout.fileName = fileName;
+        savedLayout.revision = revision;
+        savedLayout.lineOffsets.resize(array.size() + 1);
+        unsigned long long offset = 0;
+        for (size_t i = 0; i < array.size(); i++) {
+            savedLayout.lineOffsets[i] = offset;
+            offset += array.length(i) + 1;
+        }
+        savedLayout.lineOffsets[array.size()] = offset;
+        recordFileState();
+    }
+
+    // Called after the changed lines were written over the saved file at their old offsets.
+    void markPatched() {
+        savedLayout.revision = revision;
+        recordFileState();
+    }
+
+    const SavedLayout& getSavedLayout() const {
+        return savedLayout;
+    }
+
+    bool dirtyLinesSinceSave(std::vector<size_t>& lines) const {
+        return changedLinesSince(savedLayout.revision, lines);
+    }
+
+    // The most recently published version; safe to call from any thread.
+    std::shared_ptr<const DocumentVersion> latestSnapshot() const {
+        return std::atomic_load(&publishedVersion);
+    }
+
+    unsigned long long getLineVersion(size_t index) const {
+        return lineVersions[index];
+    }
+
+    // Collects the 0-based lines edited after the given revision. Returns false when the
+    // lines can no longer be listed individually, including when lines were inserted or
+    // erased since, and callers must rescan everything.
+    bool changedLinesSince(unsigned long long since, std::vector<size_t>& lines) const {
+        if (since < structureRevision) {
+            return false;
+        }
+
+        typename std::vector<LineEdit>::const_iterator first =
+            std::upper_bound(changeLog.begin(), changeLog.end(), since, editedAfter);
+        for (typename std::vector<LineEdit>::const_iterator it = first; it != changeLog.end(); ++it) {
+            if (it->kind != LineEdit::kChanged) {
+                return false;
+            }
+        }
+        for (typename std::vector<LineEdit>::const_iterator it = first; it != changeLog.end(); ++it) {
+            lines.push_back(it->index);
+        }
+        std::sort(lines.begin(), lines.end());
+        lines.erase(std::unique(lines.begin(), lines.end()), lines.end());
+        return true;
+    }
+
+    // Lists the edits after the given revision in order, for callers that can follow line
+    // insertions and erasures. Returns false when the log no longer reaches back that far.
+    bool editsSince(unsigned long long since, std::vector<LineEdit>& edits) const {
+        if (since < structureRevision) {
+            return false;
+        }
+        edits.assign(std::upper_bound(changeLog.begin(), changeLog.end(), since, editedAfter), changeLog.end());
+        return true;
+    }
+
+    // Edits made until endEditGroup() form one undo step, such as a run of typing.
+    void beginEditGroup() {
+        if (editGroupOpen) {
+            return;
+        }
+        if (trace) {
+            trace->begin(EditTrace::kBeginGroup).end();
+        }
+        editGroupOpen = true;
+    }
+
+    void endEditGroup() {
+        if (!editGroupOpen) {
+            return;
+        }
+        if (trace) {
+            trace->begin(EditTrace::kEndGroup).end();
+        }
+        editGroupOpen = false;
+        if (editGroupChanged) {
+            editGroupChanged = false;
+            history.commit(array);
+        }
+    }
+
+    const ArenaLineStore& getLines() const {
+        return array;
+    }
+
+    void setStrings(const std::vector<std::string>& data) {
+        TIME_OPERATION(timer, "StringArray::setStrings");
+        array.assign(data);
+        timer.touched(array.getLiveBytes());
+        history.replacedAll(array);
+        editGroupChanged = false;
+        touchAllLines();
+    }
+
+    // Takes over already built line storage, such as a file loaded straight into an arena.
+    void setLines(ArenaLineStore& lines) {
+        TIME_OPERATION(timer, "StringArray::setLines");
+        std::swap(array, lines);
+        timer.touched(array.getLiveBytes());
+        history.replacedAll(array);
+        editGroupChanged = false;
+        touchAllLines();
+    }
+
+    size_t getStringCount() const {
+        return array.size();
+    }
+
+    // Byte offsets count every line with its newline, matching the saved file. Positions
+    // use the 1-based line and 0-based byte position of the editing methods.
+    bool positionToOffset(size_t lineIndex, size_t position, size_t& offset) {
+        if (lineIndex < 1 || lineIndex > array.size() || position > array.length(lineIndex - 1)) {
+            return false;
+        }
+        offset = offsets.lineStart(array, lineIndex - 1) + position;
+        return true;
+    }
+
+    bool offsetToPosition(size_t offset, size_t& lineIndex, size_t& position) {
+        if (!offsets.locate(array, offset, lineIndex, position)) {
+            return false;
+        }
+        lineIndex++;
+        return true;
+    }
+
+    size_t getTextSize() {
+        return offsets.lineStart(array, array.size());
+    }
+
+    // Counts for the text as saved, with a newline after every line.
+    struct Summary {
+        size_t lines;
+        size_t words;
+        size_t bytes;
+        size_t chars;
+        size_t longestLine;
+    };
+
+    Summary summarize() {
+        Summary summary;
+        summary.lines = array.size();
+        summary.words = array.getWordCount();
+        summary.bytes = array.getLiveBytes() + array.size();
+        summary.chars = array.getCharCount() + array.size();
+        summary.longestLine = array.getLongestLine();
+        return summary;
+    }
+
+    void addString(const std::string& buffer) {
+        TIME_OPERATION(timer, "StringArray::addString");
+        if (trace) {
+            trace->begin(EditTrace::kAppend).text(buffer).end();
+        }
+        if (!array.empty()) {
+            setLine(array.size() - 1, array.line(array.size() - 1) + buffer);
+        } else {
+            insertLine(array.size(), buffer);
+        }
+        timer.touched(array.length(array.size() - 1));
+        touchLine(array.size() - 1);
+        commitEdit();
+    }
+
+    void addEmptyLine() {
+        TIME_OPERATION(timer, "StringArray::addEmptyLine");
+        if (trace) {
+            trace->begin(EditTrace::kEmptyLine).end();
+        }
+        insertLine(array.size(), "");
+        touchLine(array.size() - 1);
+        commitEdit();
+    }
+
+    // Swaps in new contents for the given 0-based lines and records them as one edit.
+    void replaceLines(const std::vector<size_t>& lineIndices, std::vector<std::string>& contents) {
+        TIME_OPERATION(timer, "StringArray::replaceLines");
+        if (trace) {
+            trace->begin(EditTrace::kReplaceLines).integer(lineIndices.size());
+            for (size_t i = 0; i < lineIndices.size(); i++) {
+                trace->integer(lineIndices[i]).text(contents[i]);
+            }
+            trace->end();
+        }
+        if (lineIndices.empty()) {
+            return;
+        }
+
+        for (size_t i = 0; i < lineIndices.size(); i++) {
+            setLine(lineIndices[i], contents[i]);
+            timer.touched(contents[i].size());
+            touchLine(lineIndices[i]);
+        }
+        commitEdit();
+    }
+
+    void printStrings() {
+        TIME_OPERATION(timer, "StringArray::printStrings");
+        for (size_t i = 0; i < array.size(); i++) {
+            std::cout << i + 1 << ": ";
+            std::cout.write(array.data(i), array.length(i));
+            std::cout << '\n';
+        }
+        std::cout.flush();
+        timer.touched(array.getLiveBytes());
+    }
+
+    // Formats lines [first, first + count) the way printStrings does, into one buffer.
+    void renderLines(size_t first, size_t count, std::string& out) const {
+        out.clear();
+        size_t last = std::min(array.size(), first + count);
+        for (size_t i = first; i < last; i++) {
+            out += std::to_string(i + 1);
+            out += ": ";
+            out.append(array.data(i), array.length(i));
+            out += '\n';
+        }
+    }
+
+    bool deleteSubstring(int lineIndex, int position, int length) {
+        TIME_OPERATION(timer, "StringArray::deleteSubstring");
+        if (trace) {
+            trace->begin(EditTrace::kDelete).integer(lineIndex).integer(position).integer(length).end();
+        }
+        timer.touched(length > 0 ? length : 0);
+        return eraseRange(lineIndex, position, length, &clipboard);
+    }
+
+    // Removes text like deleteSubstring but leaves the clipboard alone.
+    bool eraseSubstring(int lineIndex, int position, int length) {
+        TIME_OPERATION(timer, "StringArray::eraseSubstring");
+        if (trace) {
+            trace->begin(EditTrace::kErase).integer(lineIndex).integer(position).integer(length).end();
+        }
+        timer.touched(length > 0 ? length : 0);
+        return eraseRange(lineIndex, position, length, nullptr);
+    }
+
+    bool undo() {
+        TIME_OPERATION(timer, "StringArray::undo");
+        endEditGroup();
+        if (trace) {
+            trace->begin(EditTrace::kUndo).end();
+        }
+        std::vector<size_t> changedLines;
+        bool structural = false;
+        if (consecutiveUndoCount < 3 && history.undo(array, changedLines, structural)) {
+            consecutiveUndoCount++;
+            touchRestoredLines(changedLines, structural);
+            return true;
+        }
+        return false;
+    }
+
+    bool redo() {
+        TIME_OPERATION(timer, "StringArray::redo");
+        endEditGroup();
+        if (trace) {
+            trace->begin(EditTrace::kRedo).end();
+        }
+        std::vector<size_t> changedLines;
+        bool structural = false;
+        if (history.redo(array, changedLines, structural)) {
+            consecutiveUndoCount = 0;
+            touchRestoredLines(changedLines, structural);
+            return true;
+        }
+        return false;
+    }
+
+    bool insertSubstring(int lineIndex, int position, const std::string& substring, bool replace = false) {
+        TIME_OPERATION(timer, "StringArray::insertSubstring");
+        if (trace) {
+            trace->begin(EditTrace::kInsert).integer(lineIndex).integer(position).text(substring).integer(replace).end();
+        }
+        if (lineIndex < 1 || static_cast<size_t>(lineIndex) > array.size()) {
+            std::cerr << "Invalid line index." << std::endl;
+            return false;
+        }
+
+        if (position < 0 || static_cast<size_t>(position) > array.length(lineIndex - 1)) {
+            std::cerr << "Invalid position." << std::endl;
+            return false;
+        }
+
+        std::string line = array.line(lineIndex - 1);
+        if (replace) {
+            int length = substring.length();
+            line.erase(position, length);
+            line.insert(position, substring);
+        } else {
+            line.insert(position, substring);
+        }
+        setLine(lineIndex - 1, line);
+        timer.touched(line.size());
+        touchLine(lineIndex - 1);
+
+        commitEdit();
+        return true;
+    }
+
+    bool cut(int lineIndex, int position, int length) {
+        TIME_OPERATION(timer, "StringArray::cut");
+        if (trace) {
+            trace->begin(EditTrace::kCut).integer(lineIndex).integer(position).integer(length).end();
+        }
+        timer.touched(length > 0 ? length : 0);
+        return eraseRange(lineIndex, position, length, &clipboard);
+    }
+
+    bool copy(int lineIndex, int position, int length) {
+        TIME_OPERATION(timer, "StringArray::copy");
+        if (trace) {
+            trace->begin(EditTrace::kCopy).integer(lineIndex).integer(position).integer(length).end();
+        }
+        if (lineIndex < 1 || static_cast<size_t>(lineIndex) > array.size()) {
+            std::cerr << "Invalid line index." << std::endl;
+            return false;
+        }
+
+        const std::string line = array.line(lineIndex - 1);
+
+        if (position < 0 || static_cast<size_t>(position) >= line.length()) {
+            std::cerr << "Invalid position." << std::endl;
+            return false;
+        }
+
+        if (length < 0 || static_cast<size_t>(position + length) > line.length()) {
+            std::cerr << "Invalid length." << std::endl;
+            return false;
+        }
+
+        clipboard = line.substr(position, length);
+        timer.touched(clipboard.size());
+        return true;
+    }
+
+    bool paste(int lineIndex, int position) {
+        TIME_OPERATION(timer, "StringArray::paste");
+        if (trace) {
+            trace->begin(EditTrace::kPaste).integer(lineIndex).integer(position).end();
+        }
+        if (lineIndex < 1 || static_cast<size_t>(lineIndex) > array.size()) {
+            std::cerr << "Invalid line index." << std::endl;
+            return false;
+        }
+
+        if (position < 0 || static_cast<size_t>(position) > array.length(lineIndex - 1)) {
+            std::cerr << "Invalid position." << std::endl;
+            return false;
+        }
+
+        std::string line = array.line(lineIndex - 1);
+        line.insert(position, clipboard);
+        setLine(lineIndex - 1, line);
+        timer.touched(line.size());
+        touchLine(lineIndex - 1);
+        commitEdit();
+        return true;
+    }
+
+    bool splitLine(int lineIndex, int position) {
+        TIME_OPERATION(timer, "StringArray::splitLine");
+        if (trace) {
+            trace->begin(EditTrace::kSplitLine).integer(lineIndex).integer(position).end();
+        }
+        if (lineIndex < 1 || static_cast<size_t>(lineIndex) > array.size()) {
+            std::cerr << "Invalid line index." << std::endl;
+            return false;
+        }
+
+        if (position < 0 || static_cast<size_t>(position) > array.length(lineIndex - 1)) {
+            std::cerr << "Invalid position." << std::endl;
+            return false;
+        }
+
+        std::string line = array.line(lineIndex - 1);
+        setLine(lineIndex - 1, line.substr(0, position));
+        insertLine(lineIndex, line.substr(position));
+        timer.touched(line.size());
+        touchShiftedLines(lineIndex, LineEdit::kInserted);
+        touchLine(lineIndex - 1);
+        commitEdit();
+        return true;
+    }
+
+    bool joinWithNext(int lineIndex) {
+        TIME_OPERATION(timer, "StringArray::joinWithNext");
+        if (trace) {
+            trace->begin(EditTrace::kJoinLines).integer(lineIndex).end();
+        }
+        if (lineIndex < 1 || static_cast<size_t>(lineIndex) >= array.size()) {
+            std::cerr << "Invalid line index." << std::endl;
+            return false;
+        }
+
+        setLine(lineIndex - 1, array.line(lineIndex - 1) + array.line(lineIndex));
+        eraseLine(lineIndex);
+        timer.touched(array.length(lineIndex - 1));
+        touchShiftedLines(lineIndex, LineEdit::kErased);
+        touchLine(lineIndex - 1);
+        commitEdit();
+        return true;
+    }
+};
+
+struct SearchMatch {
+    size_t line;
+    size_t column;
+    size_t length;
+};
+
+// Regular expressions compiled to a Thompson NFA and matched with lazily built DFAs,
+// so matching never backtracks. Supported syntax: literals, '.', [classes], \d \w \s
+// (and \D \W \S), groups, '|', '*', '+', '?', {m}, {m,}, {m,n}, leading '^' and trailing '$'.
+class DfaRegex {
+public:
+    explicit DfaRegex(const std::string& pattern)
+        : source(pattern), pos(0), anchoredStart(false), anchoredEnd(false), literalOnly(false) {
+        std::string body = pattern;
+        if (!body.empty() && body[0] == '^') {
+            anchoredStart = true;
+            body.erase(0, 1);
+        }
+        if (!body.empty() && body[body.size() - 1] == '$' && !isEscaped(body, body.size() - 1)) {
+            anchoredEnd = true;
+            body.erase(body.size() - 1);
+        }
+
+        source = body;
+        int root = parseAlternation();
+        if (pos != source.size()) {
+            throw std::runtime_error("Unexpected ')' in regular expression.");
+        }
+
+        bool complete = true;
+        collectPrefix(root, prefix, complete);
+        literalOnly = complete && !prefix.empty() && !anchoredStart && !anchoredEnd;
+
+        forwardNfaStart = compile(root, false);
+        reverseNfaStart = compile(root, true);
+        forward.init(&nfa, forwardNfaStart, false);
+        reverse.init(&nfa, reverseNfaStart, !anchoredEnd);
+    }
+
+    const std::string& literalPrefix() const {
+        return prefix;
+    }
+
+    // Cheap test on raw bytes: false means the line cannot contain a match.
+    bool mayMatch(const char* data, size_t length) const {
+        if (prefix.empty()) {
+            return true;
+        }
+        if (anchoredStart) {
+            return length >= prefix.size() && memcmp(data, prefix.data(), prefix.size()) == 0;
+        }
+
+        const char* end = data + length;
+        for (const char* p = data; static_cast<size_t>(end - p) >= prefix.size(); p++) {
+            p = static_cast<const char*>(memchr(p, prefix[0], (end - p) - prefix.size() + 1));
+            if (!p) {
+                return false;
+            }
+            if (memcmp(p, prefix.data(), prefix.size()) == 0) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Appends every leftmost-longest, non-overlapping, non-empty match in the line.
+    void findAll(const std::string& line, size_t lineNumber, std::vector<SearchMatch>& matches) {
+        if (literalOnly) {
+            size_t found = line.find(prefix);
+            while (found != std::string::npos) {
+                SearchMatch match = {lineNumber, found, prefix.size()};
+                matches.push_back(match);
+                found = line.find(prefix, found + prefix.size());
+            }
+            return;
+        }
+
+        if (!prefix.empty()) {
+            if (anchoredStart ? line.compare(0, prefix.size(), prefix) != 0 : line.find(prefix) == std::string::npos) {
+                return;
+            }
+        }
+
+        if (anchoredStart) {
+            size_t scanned = 0;
+            size_t end = longestMatchFrom(line, 0, scanned);
+            if (end != std::string::npos && end > 0) {
+                SearchMatch match = {lineNumber, 0, end};
+                matches.push_back(match);
+            }
+            return;
+        }
+
+        // One backward pass marks every position where some match begins.
+        size_t length = line.size();
+        canStart.assign(length + 1, 0);
+        int state = reverse.startState();
+        for (size_t p = length; ; p--) {
+            if (reverse.isAccepting(state)) {
+                canStart[p] = 1;
+            }
+            if (p == 0) {
+                break;
+            }
+            state = reverse.step(state, static_cast<unsigned char>(line[p - 1]));
+            if (state == LazyDfa::kDead) {
+                break;
+            }
+        }
+
+        // Each forward scan runs until the DFA dies, which can be far past the match it reports
+        // (a|a.*b over a run of a's), so after a few passes' worth of rescanning the longest end
+        // of every remaining start comes from one backward pass over the NFA instead.
+        size_t start = 0;
+        size_t scanned = 0;
+        bool endsKnown = false;
+        while (start <= length) {
+            while (start <= length && !canStart[start]) {
+                start++;
+            }
+            if (start > length) {
+                break;
+            }
+
+            size_t end;
+            if (endsKnown) {
+                end = longestEnd[start];
+            } else {
+                end = longestMatchFrom(line, start, scanned);
+                if (scanned > static_cast<size_t>(kScanPasses) * (length + kScanSlack)) {
+                    computeLongestEnds(line, start);
+                    endsKnown = true;
+                }
+            }
+            if (end != std::string::npos && end > start) {
+                SearchMatch match = {lineNumber, start, end - start};
+                matches.push_back(match);
+                start = end;
+            } else {
+                start++;
+            }
+        }
+    }
+
+private:
+    enum NodeType { NodeChars, NodeConcat, NodeAlternate, NodeRepeat, NodeEmpty };
+
+    struct Node {
+        NodeType type;
+        std::bitset<256> chars;
+        std::vector<int> children;
+        int minCount;
+        int maxCount;
+    };
+
+    enum NfaType { NfaChars, NfaSplit, NfaEpsilon, NfaMatch };
+
+    struct NfaState {
+        NfaType type;
+        int out;
+        int out1;
+        std::bitset<256> chars;
+    };
+
+    struct Fragment {
+        int start;
+        int end;
+    };
+
+    class LazyDfa {
+    public:
+        enum { kDead = -1 };
+
+        LazyDfa() : nfa(nullptr), unanchored(false), start(kDead) {}
+
+        void init(const std::vector<NfaState>* states, int nfaStart, bool isUnanchored) {
+            nfa = states;
+            unanchored = isUnanchored;
+            startSet.clear();
+            std::vector<int> seeds(1, nfaStart);
+            closure(seeds, startSet);
+            reset();
+        }
+
+        int startState() const {
+            return start;
+        }
+
+        bool isAccepting(int state) const {
+            return accepting[state] != 0;
+        }
+
+        int step(int state, unsigned char c) {
+            int next = table[static_cast<size_t>(state) * 256 + c];
+            if (next != kUnknown) {
+                return next;
+            }
+
+            std::vector<int> seeds;
+            const std::vector<int>& current = sets[state];
+            for (size_t i = 0; i < current.size(); i++) {
+                const NfaState& nfaState = (*nfa)[current[i]];
+                if (nfaState.type == NfaChars && nfaState.chars[c]) {
+                    seeds.push_back(nfaState.out);
+                }
+            }
+            if (unanchored) {
+                seeds.insert(seeds.end(), startSet.begin(), startSet.end());
+            }
+
+            std::vector<int> nextSet;
+            closure(seeds, nextSet);
+            if (nextSet.empty()) {
+                table[static_cast<size_t>(state) * 256 + c] = kDead;
+                return kDead;
+            }
+
+            if (sets.size() >= static_cast<size_t>(kMaxStates)) {
+                reset();
+                return intern(nextSet);
+            }
+
+            next = intern(nextSet);
+            table[static_cast<size_t>(state) * 256 + c] = next;
+            return next;
+        }
+
+    private:
+        enum { kUnknown = -2, kMaxStates = 4096 };
+
+        const std::vector<NfaState>* nfa;
+        bool unanchored;
+        int start;
+        std::vector<int> startSet;
+        std::vector<std::vector<int>> sets;
+        std::vector<char> accepting;
+        std::vector<int> table;
+        std::map<std::vector<int>, int> index;
+
+        void reset() {
+            sets.clear();
+            accepting.clear();
+            table.clear();
+            index.clear();
+            start = intern(startSet);
+        }
+
+        int intern(const std::vector<int>& set) {
+            std::map<std::vector<int>, int>::const_iterator it = index.find(set);
+            if (it != index.end()) {
+                return it->second;
+            }
+
+            int id = static_cast<int>(sets.size());
+            bool isMatch = false;
+            for (size_t i = 0; i < set.size(); i++) {
+                if ((*nfa)[set[i]].type == NfaMatch) {
+                    isMatch = true;
+                }
+            }
+            sets.push_back(set);
+            accepting.push_back(isMatch ? 1 : 0);
+            table.resize(table.size() + 256, static_cast<int>(kUnknown));
+            index[set] = id;
+            return id;
+        }
+
+        // Keeps only the states that consume input or accept, sorted so equal sets compare equal.
+        void closure(const std::vector<int>& seeds, std::vector<int>& result) const {
+            std::vector<char> visited(nfa->size(), 0);
+            std::vector<int> pending(seeds);
+            result.clear();
+            while (!pending.empty()) {
+                int id = pending.back();
+                pending.pop_back();
+                if (id < 0 || visited[id]) {
+                    continue;
+                }
+                visited[id] = 1;
+
+                const NfaState& nfaState = (*nfa)[id];
+                if (nfaState.type == NfaSplit) {
+                    pending.push_back(nfaState.out1);
+                    pending.push_back(nfaState.out);
+                } else if (nfaState.type == NfaEpsilon) {
+                    pending.push_back(nfaState.out);
+                } else {
+                    result.push_back(id);
+                }
+            }
+            std::sort(result.begin(), result.end());
+        }
+    };
+
+    // Counted repeats are expanded into copies, so nesting multiplies the program size; it is
+    // capped as a whole, for both directions together.
+    enum { kMaxRepeat = 1000, kMaxNfaStates = 1 << 20, kScanPasses = 4, kScanSlack = 64 };
+
+    std::string source;
+    size_t pos;
+    bool anchoredStart;
+    bool anchoredEnd;
+    bool literalOnly;
+    std::string prefix;
+    std::vector<Node> nodes;
+    std::vector<NfaState> nfa;
+    int forwardNfaStart;
+    int reverseNfaStart;
+    LazyDfa forward;
+    LazyDfa reverse;
+    std::vector<char> canStart;
+    std::vector<size_t> longestEnd;
+    std::vector<int> endStates;
+    std::vector<int> startStates;
+    std::vector<std::vector<int>> followStates;
+    std::vector<long long> stateEnd;
+    std::vector<long long> followEnd;
+
+    static bool isEscaped(const std::string& text, size_t index) {
+        size_t backslashes = 0;
+        while (index > 0 && text[index - 1] == '\\') {
+            backslashes++;
+            index--;
+        }
+        return backslashes % 2 == 1;
+    }
+
+    size_t longestMatchFrom(const std::string& line, size_t start, size_t& scanned) {
+        size_t length = line.size();
+        int state = forward.startState();
+        size_t best = std::string::npos;
+        if (forward.isAccepting(state) && (!anchoredEnd || start == length)) {
+            best = start;
+        }
+
+        for (size_t p = start; p < length; p++) {
+            scanned++;
+            state = forward.step(state, static_cast<unsigned char>(line[p]));
+            if (state == LazyDfa::kDead) {
+                break;
+            }
+            if (forward.isAccepting(state) && (!anchoredEnd || p + 1 == length)) {
+                best = p + 1;
+            }
+        }
+        return best;
+    }
+
+    // Fills longestEnd[p] for every p >= from with the end of the longest match starting at p
+    // (npos if none), walking the line backwards once: the furthest end reachable from an NFA
+    // state at p follows from the values already known at p + 1.
+    void computeLongestEnds(const std::string& line, size_t from) {
+        if (endStates.empty()) {
+            collectEndStates();
+        }
+
+        size_t length = line.size();
+        longestEnd.assign(length + 1, std::string::npos);
+        stateEnd.assign(nfa.size(), -1);
+        followEnd.assign(nfa.size(), -1);
+        for (size_t p = length + 1; p-- > from; ) {
+            for (size_t i = 0; i < endStates.size(); i++) {
+                const NfaState& nfaState = nfa[endStates[i]];
+                if (nfaState.type == NfaMatch) {
+                    stateEnd[endStates[i]] = !anchoredEnd || p == length ? static_cast<long long>(p) : -1;
+                } else {
+                    bool consumes = p < length && nfaState.chars[static_cast<unsigned char>(line[p])];
+                    stateEnd[endStates[i]] = consumes ? followEnd[endStates[i]] : -1;
+                }
+            }
+            for (size_t i = 0; i < endStates.size(); i++) {
+                followEnd[endStates[i]] = furthestEnd(followStates[endStates[i]]);
+            }
+
+            long long end = furthestEnd(startStates);
+            if (end >= 0) {
+                longestEnd[p] = static_cast<size_t>(end);
+            }
+        }
+    }
+
+    long long furthestEnd(const std::vector<int>& states) const {
+        long long end = -1;
+        for (size_t i = 0; i < states.size(); i++) {
+            end = std::max(end, stateEnd[states[i]]);
+        }
+        return end;
+    }
+
+    // Lists the forward NFA's consuming and accepting states and, for each of them and for the
+    // start, the ones reachable without consuming input.
+    void collectEndStates() {
+        followStates.assign(nfa.size(), std::vector<int>());
+        std::vector<char> seen(nfa.size(), 0);
+        std::vector<int> pending(1, forwardNfaStart);
+        while (!pending.empty()) {
+            int id = pending.back();
+            pending.pop_back();
+            if (id < 0 || seen[id]) {
+                continue;
+            }
+            seen[id] = 1;
+
+            const NfaState& nfaState = nfa[id];
+            if (nfaState.type == NfaChars || nfaState.type == NfaMatch) {
+                endStates.push_back(id);
+            }
+            if (nfaState.type != NfaMatch) {
+                pending.push_back(nfaState.out);
+            }
+            if (nfaState.type == NfaSplit) {
+                pending.push_back(nfaState.out1);
+            }
+        }
+
+        epsilonClosure(forwardNfaStart, startStates);
+        for (size_t i = 0; i < endStates.size(); i++) {
+            if (nfa[endStates[i]].type == NfaChars) {
+                epsilonClosure(nfa[endStates[i]].out, followStates[endStates[i]]);
+            }
+        }
+    }
+
+    void epsilonClosure(int seed, std::vector<int>& result) const {
+        std::vector<char> visited(nfa.size(), 0);
+        std::vector<int> pending(1, seed);
+        result.clear();
+        while (!pending.empty()) {
+            int id = pending.back();
+            pending.pop_back();
+            if (id < 0 || visited[id]) {
+                continue;
+            }
+            visited[id] = 1;
+
+            const NfaState& nfaState = nfa[id];
+            if (nfaState.type == NfaSplit) {
+                pending.push_back(nfaState.out1);
+                pending.push_back(nfaState.out);
+            } else if (nfaState.type == NfaEpsilon) {
+                pending.push_back(nfaState.out);
+            } else {
+                result.push_back(id);
+            }
+        }
+    }
+
+    int addNode(NodeType type) {
+        Node node;
+        node.type = type;
+        node.minCount = 0;
+        node.maxCount = 0;
+        nodes.push_back(node);
+        return static_cast<int>(nodes.size()) - 1;
+    }
+
+    int parseAlternation() {
+        int left = parseConcatenation();
+        if (pos >= source.size() || source[pos] != '|') {
+            return left;
+        }
+
+        int alternate = addNode(NodeAlternate);
+        nodes[alternate].children.push_back(left);
+        while (pos < source.size() && source[pos] == '|') {
+            pos++;
+            int right = parseConcatenation();
+            nodes[alternate].children.push_back(right);
+        }
+        return alternate;
+    }
+
+    int parseConcatenation() {
+        int concat = addNode(NodeConcat);
+        while (pos < source.size() && source[pos] != '|' && source[pos] != ')') {
+            int item = parseRepeat();
+            nodes[concat].children.push_back(item);
+        }
+        if (nodes[concat].children.empty()) {
+            nodes[concat].type = NodeEmpty;
+        }
+        return concat;
+    }
+
+    int parseRepeat() {
+        int atom = parseAtom();
+        while (pos < source.size()) {
+            int minCount, maxCount;
+            char c = source[pos];
+            if (c == '*') {
+                minCount = 0;
+                maxCount = -1;
+                pos++;
+            } else if (c == '+') {
+                minCount = 1;
+                maxCount = -1;
+                pos++;
+            } else if (c == '?') {
+                minCount = 0;
+                maxCount = 1;
+                pos++;
+            } else if (c == '{' && parseBounds(minCount, maxCount)) {
+            } else {
+                break;
+            }
+
+            int repeat = addNode(NodeRepeat);
+            nodes[repeat].children.push_back(atom);
+            nodes[repeat].minCount = minCount;
+            nodes[repeat].maxCount = maxCount;
+            atom = repeat;
+        }
+        return atom;
+    }
+
+    // Parses "{m}", "{m,}" or "{m,n}"; anything else leaves '{' to be read as a literal.
+    bool parseBounds(int& minCount, int& maxCount) {
+        size_t p = pos + 1;
+        if (p >= source.size() || !isdigit(static_cast<unsigned char>(source[p]))) {
+            return false;
+        }
+
+        minCount = readNumber(p);
+        maxCount = minCount;
+        if (p < source.size() && source[p] == ',') {
+            p++;
+            maxCount = -1;
+            if (p < source.size() && isdigit(static_cast<unsigned char>(source[p]))) {
+                maxCount = readNumber(p);
+            }
+        }
+        if (p >= source.size() || source[p] != '}') {
+            return false;
+        }
+        if (minCount > kMaxRepeat || maxCount > kMaxRepeat || (maxCount != -1 && maxCount < minCount)) {
+            throw std::runtime_error("Invalid repetition bounds in regular expression.");
+        }
+        pos = p + 1;
+        return true;
+    }
+
+    int readNumber(size_t& p) const {
+        int value = 0;
+        while (p < source.size() && isdigit(static_cast<unsigned char>(source[p]))) {
+            value = std::min(value * 10 + (source[p] - '0'), static_cast<int>(kMaxRepeat) + 1);
+            p++;
+        }
+        return value;
+    }
+
+    int parseAtom() {
+        char c = source[pos];
+        if (c == '(') {
+            pos++;
+            int inner = parseAlternation();
+            if (pos >= source.size() || source[pos] != ')') {
+                throw std::runtime_error("Missing ')' in regular expression.");
+            }
+            pos++;
+            return inner;
+        }
+        if (c == '*' || c == '+' || c == '?') {
+            throw std::runtime_error("Nothing to repeat in regular expression.");
+        }
+
+        int node = addNode(NodeChars);
+        if (c == '[') {
+            pos++;
+            parseClass(nodes[node].chars);
+        } else if (c == '.') {
+            pos++;
+            nodes[node].chars.set();
+        } else if (c == '\\') {
+            pos++;
+            if (pos >= source.size()) {
+                throw std::runtime_error("Trailing '\\' in regular expression.");
+            }
+            parseEscape(source[pos++], nodes[node].chars);
+        } else {
+            pos++;
+            nodes[node].chars.set(static_cast<unsigned char>(c));
+        }
+        return node;
+    }
+
+    static void parseEscape(char c, std::bitset<256>& chars) {
+        std::bitset<256> set;
+        switch (c) {
+            case 'd': case 'D':
+                for (int i = '0'; i <= '9'; i++) set.set(i);
+                break;
+            case 'w': case 'W':
+                for (int i = 0; i < 256; i++) {
+                    if (isalnum(i) || i == '_') set.set(i);
+                }
+                break;
+            case 's': case 'S':
+                for (int i = 0; i < 256; i++) {
+                    if (isspace(i)) set.set(i);
+                }
+                break;
+            case 't':
+                set.set('\t');
+                break;
+            case 'n':
+                set.set('\n');
+                break;
+            default:
+                set.set(static_cast<unsigned char>(c));
+                break;
+        }
+        if (c == 'D' || c == 'W' || c == 'S') {
+            set.flip();
+        }
+        chars |= set;
+    }
+
+    void parseClass(std::bitset<256>& chars) {
+        bool negate = false;
+        if (pos < source.size() && source[pos] == '^') {
+            negate = true;
+            pos++;
+        }
+
+        bool first = true;
+        while (pos < source.size() && (source[pos] != ']' || first)) {
+            first = false;
+            unsigned char low = static_cast<unsigned char>(source[pos++]);
+            if (low == '\\' && pos < source.size()) {
+                char escape = source[pos++];
+                if (escape == 'd' || escape == 'D' || escape == 'w' || escape == 'W' || escape == 's' || escape == 'S') {
+                    parseEscape(escape, chars);
+                    continue;
+                }
+                std::bitset<256> single;
+                parseEscape(escape, single);
+                for (int i = 0; i < 256; i++) {
+                    if (single[i]) low = static_cast<unsigned char>(i);
+                }
+            }
+
+            unsigned char high = low;
+            if (pos + 1 < source.size() && source[pos] == '-' && source[pos + 1] != ']') {
+                high = static_cast<unsigned char>(source[pos + 1]);
+                pos += 2;
+                if (high < low) {
+                    throw std::runtime_error("Invalid range in character class.");
+                }
+            }
+            for (int i = low; i <= high; i++) {
+                chars.set(i);
+            }
+        }
+        if (pos >= source.size()) {
+            throw std::runtime_error("Missing ']' in regular expression.");
+        }
+        pos++;
+
+        if (negate) {
+            chars.flip();
+        }
+    }
+
+    // Leading literal bytes every match must start with; complete is cleared once
+    // something other than a single-byte literal is reached.
+    void collectPrefix(int id, std::string& out, bool& complete) const {
+        const Node& node = nodes[id];
+        if (node.type == NodeChars && node.chars.count() == 1) {
+            for (int i = 0; i < 256; i++) {
+                if (node.chars[i]) out += static_cast<char>(i);
+            }
+            return;
+        }
+        if (node.type == NodeConcat) {
+            for (size_t i = 0; i < node.children.size() && complete; i++) {
+                collectPrefix(node.children[i], out, complete);
+            }
+            return;
+        }
+        if (node.type == NodeRepeat && node.minCount >= 1) {
+            bool childComplete = true;
+            collectPrefix(node.children[0], out, childComplete);
+        }
+        complete = false;
+    }
+
+    int addState(NfaType type, int out = -1, int out1 = -1) {
+        if (nfa.size() >= static_cast<size_t>(kMaxNfaStates)) {
+            throw std::runtime_error("Regular expression is too large.");
+        }
+        NfaState state;
+        state.type = type;
+        state.out = out;
+        state.out1 = out1;
+        nfa.push_back(state);
+        return static_cast<int>(nfa.size()) - 1;
+    }
+
+    // Compiles the AST; the reversed NFA matches the mirror image and drives the backward scan.
+    int compile(int root, bool reversed) {
+        Fragment fragment = build(root, reversed);
+        int match = addState(NfaMatch);
+        nfa[fragment.end].out = match;
+        return fragment.start;
+    }
+
+    Fragment build(int id, bool reversed) {
+        const Node& node = nodes[id];
+        Fragment fragment;
+        switch (node.type) {
+            case NodeChars: {
+                fragment.end = addState(NfaEpsilon);
+                fragment.start = addState(NfaChars, fragment.end);
+                nfa[fragment.start].chars = node.chars;
+                break;
+            }
+            case NodeEmpty: {
+                fragment.start = fragment.end = addState(NfaEpsilon);
+                break;
+            }
+            case NodeConcat: {
+                fragment.start = fragment.end = -1;
+                for (size_t i = 0; i < node.children.size(); i++) {
+                    size_t child = reversed ? node.children.size() - 1 - i : i;
+                    Fragment part = build(node.children[child], reversed);
+                    if (fragment.start == -1) {
+                        fragment = part;
+                    } else {
+                        nfa[fragment.end].out = part.start;
+                        fragment.end = part.end;
+                    }
+                }
+                break;
+            }
+            case NodeAlternate: {
+                fragment.end = addState(NfaEpsilon);
+                fragment.start = -1;
+                for (size_t i = 0; i < node.children.size(); i++) {
+                    Fragment part = build(node.children[i], reversed);
+                    nfa[part.end].out = fragment.end;
+                    fragment.start = fragment.start == -1 ? part.start : addState(NfaSplit, fragment.start, part.start);
+                }
+                break;
+            }
+            case NodeRepeat: {
+                fragment.start = fragment.end = addState(NfaEpsilon);
+                for (int i = 0; i < node.minCount; i++) {
+                    Fragment part = build(node.children[0], reversed);
+                    nfa[fragment.end].out = part.start;
+                    fragment.end = part.end;
+                }
+                if (node.maxCount == -1) {
+                    Fragment part = build(node.children[0], reversed);
+                    int exit = addState(NfaEpsilon);
+                    int loop = addState(NfaSplit, part.start, exit);
+                    nfa[fragment.end].out = loop;
+                    nfa[part.end].out = loop;
+                    fragment.end = exit;
+                } else {
+                    int exit = addState(NfaEpsilon);
+                    for (int i = node.minCount; i < node.maxCount; i++) {
+                        Fragment part = build(node.children[0], reversed);
+                        int split = addState(NfaSplit, part.start, exit);
+                        nfa[fragment.end].out = split;
+                        fragment.end = part.end;
+                    }
+                    nfa[fragment.end].out = exit;
+                    fragment.end = exit;
+                }
+                break;
+            }
+        }
+        return fragment;
+    }
+};
+
+struct PatternMatch {
+    SearchMatch match;
+    size_t pattern;
+};
+
+// Aho-Corasick automaton over a compressed byte alphabet. The goto function is fully
+// resolved into one flat table, so scanning costs a single lookup per input byte.
+class AhoCorasick {
+public:
+    explicit AhoCorasick(const std::vector<std::string>& patternList) : classCount(1) {
+        for (size_t i = 0; i < patternList.size(); i++) {
+            if (!patternList[i].empty() && std::find(patterns.begin(), patterns.end(), patternList[i]) == patterns.end()) {
+                patterns.push_back(patternList[i]);
+            }
+        }
+
+        std::fill(byteClass, byteClass + 256, 0);
+        for (size_t i = 0; i < patterns.size(); i++) {
+            for (size_t j = 0; j < patterns[i].size(); j++) {
+                unsigned char c = static_cast<unsigned char>(patterns[i][j]);
+                if (byteClass[c] == 0) {
+                    byteClass[c] = classCount++;
+                }
+            }
+        }
+
+        buildTrie();
+        buildLinks();
+    }
+
+    const std::vector<std::string>& getPatterns() const {
+        return patterns;
+    }
+
+    size_t getStateCount() const {
+        return terminal.size();
+    }
+
+    // Appends every (possibly overlapping) occurrence of every pattern in the line.
+    void findAll(const std::string& line, size_t lineNumber, std::vector<PatternMatch>& matches) const {
+        int state = 0;
+        for (size_t i = 0; i < line.size(); i++) {
+            state = transitions[static_cast<size_t>(state) * classCount + byteClass[static_cast<unsigned char>(line[i])]];
+            for (int hit = terminal[state] >= 0 ? state : dictionaryLink[state]; hit > 0; hit = dictionaryLink[hit]) {
+                size_t length = patterns[terminal[hit]].size();
+                PatternMatch found = {{lineNumber, i + 1 - length, length}, static_cast<size_t>(terminal[hit])};
+                matches.push_back(found);
+            }
+        }
+    }
+
+private:
+    std::vector<std::string> patterns;
+    int byteClass[256];
+    int classCount;
+    std::vector<int> transitions;
+    std::vector<int> terminal;
+    std::vector<int> dictionaryLink;
+
+    int addState() {
+        transitions.resize(transitions.size() + classCount, -1);
+        terminal.push_back(-1);
+        dictionaryLink.push_back(0);
+        return static_cast<int>(terminal.size()) - 1;
+    }
+
+    void buildTrie() {
+        addState();
+        for (size_t i = 0; i < patterns.size(); i++) {
+            int state = 0;
+            for (size_t j = 0; j < patterns[i].size(); j++) {
+                size_t slot = static_cast<size_t>(state) * classCount + byteClass[static_cast<unsigned char>(patterns[i][j])];
+                if (transitions[slot] == -1) {
+                    int next = addState();
+                    transitions[slot] = next;
+                }
+                state = transitions[slot];
+            }
+            terminal[state] = static_cast<int>(i);
+        }
+    }
+
+    // Breadth-first pass that fills failure transitions into the table and links each
+    // state to the nearest proper suffix that ends a pattern.
+    void buildLinks() {
+        std::vector<int> failure(terminal.size(), 0);
+        std::vector<int> queue;
+        queue.reserve(terminal.size());
+
+        for (int c = 0; c < classCount; c++) {
+            int& next = transitions[c];
+            if (next == -1) {
+                next = 0;
+            } else {
+                queue.push_back(next);
+            }
+        }
+
+        for (size_t head = 0; head < queue.size(); head++) {
+            int state = queue[head];
+            int fail = failure[state];
+            dictionaryLink[state] = terminal[fail] >= 0 ? fail : dictionaryLink[fail];
+
+            for (int c = 0; c < classCount; c++) {
+                int& next = transitions[static_cast<size_t>(state) * classCount + c];
+                int fallback = transitions[static_cast<size_t>(fail) * classCount + c];
+                if (next == -1) {
+                    next = fallback;
+                } else {
+                    failure[next] = fallback;
+                    queue.push_back(next);
+                }
+            }
+        }
+    }
+};
+
+struct FuzzyMatch {
+    SearchMatch match;
+    size_t distance;
+};
+
+// Approximate matching with Myers' bit-vector algorithm: one 64-bit word holds a whole
+// column of the edit-distance table, so each text byte costs a handful of word operations.
+class MyersMatcher {
+public:
+    MyersMatcher(const std::string& pattern, size_t maxDistance) : pattern(pattern), maxDistance(maxDistance) {
+        if (pattern.empty() || pattern.size() > 64) {
+            throw std::runtime_error("Fuzzy pattern length must be between 1 and 64 characters.");
+        }
+        if (maxDistance >= pattern.size()) {
+            throw std::runtime_error("Maximum distance must be smaller than the pattern length.");
+        }
+
+        std::fill(peq, peq + 256, 0);
+        for (size_t i = 0; i < pattern.size(); i++) {
+            peq[static_cast<unsigned char>(pattern[i])] |= 1ULL << i;
+        }
+        highBit = 1ULL << (pattern.size() - 1);
+    }
+
+    // Appends the matches that reach the smallest distance found in the line, if it is
+    // within the limit. Runs of adjacent end positions are reported once.
+    void findBest(const std::string& line, size_t lineNumber, std::vector<FuzzyMatch>& matches) {
+        unsigned long long pv = ~0ULL;
+        unsigned long long mv = 0;
+        size_t score = pattern.size();
+        size_t best = maxDistance + 1;
+        ends.clear();
+
+        for (size_t i = 0; i < line.size(); i++) {
+            unsigned long long eq = peq[static_cast<unsigned char>(line[i])];
+            unsigned long long xv = eq | mv;
+            unsigned long long xh = (((eq & pv) + pv) ^ pv) | eq;
+            unsigned long long ph = mv | ~(xh | pv);
+            unsigned long long mh = pv & xh;
+            if (ph & highBit) {
+                score++;
+            } else if (mh & highBit) {
+                score--;
+            }
+            ph <<= 1;
+            mh <<= 1;
+            pv = mh | ~(xv | ph);
+            mv = ph & xv;
+
+            if (score < best) {
+                best = score;
+                ends.clear();
+            }
+            if (score == best) {
+                if (ends.empty() || ends.back() != i) {
+                    ends.push_back(i + 1);
+                } else {
+                    ends.back() = i + 1;
+                }
+            }
+        }
+
+        if (best > maxDistance) {
+            return;
+        }
+        for (size_t i = 0; i < ends.size(); i++) {
+            size_t start = matchStart(line, ends[i], best);
+            FuzzyMatch found = {{lineNumber, start, ends[i] - start}, best};
+            matches.push_back(found);
+        }
+    }
+
+private:
+    std::string pattern;
+    size_t maxDistance;
+    unsigned long long peq[256];
+    unsigned long long highBit;
+    std::vector<size_t> ends;
+    std::vector<size_t> previous;
+    std::vector<size_t> current;
+
+    // Recovers where a match ending at end begins with a small DP over the reversed
+    // pattern, preferring the span whose length is closest to the pattern's.
+    size_t matchStart(const std::string& line, size_t end, size_t distance) {
+        size_t m = pattern.size();
+        size_t window = std::min(end, m + distance);
+        previous.resize(m + 1);
+        current.resize(m + 1);
+        for (size_t i = 0; i <= m; i++) {
+            previous[i] = i;
+        }
+
+        size_t bestLength = distance >= m ? 0 : std::string::npos;
+        for (size_t j = 1; j <= window; j++) {
+            char c = line[end - j];
+            current[0] = j;
+            for (size_t i = 1; i <= m; i++) {
+                size_t substitution = previous[i - 1] + (pattern[m - i] == c ? 0 : 1);
+                current[i] = std::min(substitution, std::min(previous[i], current[i - 1]) + 1);
+            }
+            previous.swap(current);
+
+            if (previous[m] == distance) {
+                size_t gap = j > m ? j - m : m - j;
+                size_t bestGap = bestLength > m ? bestLength - m : m - bestLength;
+                if (bestLength == std::string::npos || gap < bestGap) {
+                    bestLength = j;
+                }
+            }
+        }
+        return end - (bestLength == std::string::npos ? std::min(end, m) : bestLength);
+    }
+};
+
+// A match found on disk, with where its line starts in the file so the line can be read
+// back for printing instead of being kept in memory.
+struct GrepMatch {
+    SearchMatch match;
+    unsigned long long lineOffset;
+    size_t lineLength;
+};
+
+struct GrepResult {
+    std::string fileName;
+    std::vector<GrepMatch> matches;
+    std::string error;
+};
+
+class SearchFunctions {
+public:
+    static void findLiteral(const std::string& line, size_t lineNumber, const std::string& pattern, std::vector<SearchMatch>& matches) {
+        for (size_t found = line.find(pattern); found != std::string::npos; found = line.find(pattern, found + pattern.size())) {
+            SearchMatch match = {lineNumber, found, pattern.size()};
+            matches.push_back(match);
+        }
+    }
+
+    static std::vector<SearchMatch> searchRegexInArray(const ArenaLineStore& array, const std::string& pattern) {
+        TraceSpan span("SearchFunctions::searchRegexInArray");
+        DfaRegex regex(pattern);
+        std::vector<SearchMatch> matches;
+        std::string scratch;
+
+        for (size_t i = 0; i < array.size(); i++) {
+            if (regex.mayMatch(array.data(i), array.length(i))) {
+                regex.findAll(array.fetch(i, scratch), i + 1, matches);
+            }
+        }
+        return matches;
+    }
+
+    static void searchFileOnDisk(const std::string& pattern, bool useRegex, GrepResult& result) {
+        TraceSpan span("SearchFunctions::searchFileOnDisk");
+        std::ifstream file(result.fileName, std::ios::binary);
+        if (!file.is_open()) {
+            result.error = "Error opening the file.";
+            return;
+        }
+
+        std::unique_ptr<DfaRegex> regex(useRegex ? new DfaRegex(pattern) : nullptr);
+        const size_t blockSize = 1 << 20;
+        std::vector<char> buffer(blockSize);
+        std::vector<SearchMatch> matches;
+        std::string line;
+        size_t carried = 0;
+        size_t lineNumber = 0;
+        unsigned long long bufferOffset = 0;
+
+        while (true) {
+            if (carried == buffer.size()) {
+                buffer.resize(buffer.size() * 2);
+            }
+            file.read(&buffer[carried], buffer.size() - carried);
+            size_t filled = carried + static_cast<size_t>(file.gcount());
+            bool finished = filled == carried;
+
+            size_t lineStart = 0;
+            while (lineStart < filled) {
+                const char* newline = static_cast<const char*>(memchr(&buffer[lineStart], '\n', filled - lineStart));
+                if (!newline && !finished) {
+                    break;
+                }
+                size_t lineEnd = newline ? static_cast<size_t>(newline - &buffer[0]) : filled;
+
+                lineNumber++;
+                if (regex && !regex->mayMatch(&buffer[lineStart], lineEnd - lineStart)) {
+                    lineStart = lineEnd + 1;
+                    continue;
+                }
+                line.assign(&buffer[lineStart], lineEnd - lineStart);
+                matches.clear();
+                if (regex) {
+                    regex->findAll(line, lineNumber, matches);
+                } else {
+                    findLiteral(line, lineNumber, pattern, matches);
+                }
+                for (size_t i = 0; i < matches.size(); i++) {
+                    GrepMatch found = {matches[i], bufferOffset + lineStart, line.size()};
+                    result.matches.push_back(found);
+                }
+                lineStart = lineEnd + 1;
+            }
+
+            if (finished) {
+                break;
+            }
+            carried = lineStart < filled ? filled - lineStart : 0;
+            bufferOffset += filled - carried;
+            if (carried > 0 && lineStart > 0) {
+                memmove(&buffer[0], &buffer[lineStart], carried);
+            }
+        }
+    }
+
+    static void printSubstringMatches(const std::map<size_t, size_t>& hits, const std::string& substring) {
+        for (std::map<size_t, size_t>::const_iterator it = hits.begin(); it != hits.end(); ++it) {
+            std::cout << "Substring found in line " << it->first + 1 << " at position " << it->second << ": " << substring << std::endl;
+        }
+
+        if (hits.empty()) {
+            std::cout << "Substring not found in any line." << std::endl;
+        }
+    }
+
+    static void printMatches(const ArenaLineStore& array, const std::vector<SearchMatch>& matches) {
+        for (size_t i = 0; i < matches.size(); i++) {
+            const SearchMatch& match = matches[i];
+            std::cout << "Match found in line " << match.line << " at position " << match.column
+                      << " (length " << match.length << "): "
+                      << std::string(array.data(match.line - 1) + match.column, match.length) << std::endl;
+        }
+
+        if (matches.empty()) {
+            std::cout << "Pattern not found in any line." << std::endl;
+        } else {
+            std::cout << "Total matches: " << matches.size() << std::endl;
+        }
+    }
+
+    static std::vector<FuzzyMatch> fuzzySearchInArray(const ArenaLineStore& array, const std::string& pattern, size_t maxDistance) {
+        TraceSpan span("SearchFunctions::fuzzySearchInArray");
+        MyersMatcher matcher(pattern, maxDistance);
+        std::vector<FuzzyMatch> matches;
+        std::string scratch;
+
+        for (size_t i = 0; i < array.size(); i++) {
+            matcher.findBest(array.fetch(i, scratch), i + 1, matches);
+        }
+        return matches;
+    }
+
+    static void printFuzzyMatches(const ArenaLineStore& array, const std::vector<FuzzyMatch>& matches) {
+        for (size_t i = 0; i < matches.size(); i++) {
+            const FuzzyMatch& found = matches[i];
+            std::cout << "Match found in line " << found.match.line << " at position " << found.match.column
+                      << " (distance " << found.distance << "): "
+                      << std::string(array.data(found.match.line - 1) + found.match.column, found.match.length) << std::endl;
+        }
+
+        if (matches.empty()) {
+            std::cout << "No close match found in any line." << std::endl;
+        }
+    }
+
+    // Builds the rewritten text of every affected line in a single left-to-right pass.
+    // Only changed lines are returned, leaving the caller to commit them as one edit.
+    static size_t replaceAllInArray(const ArenaLineStore& array, const std::string& pattern,
+                                    const std::string& replacement, bool useRegex,
+                                    std::vector<size_t>& changedLines, std::vector<std::string>& contents) {
+        TraceSpan span("SearchFunctions::replaceAllInArray");
+        if (pattern.empty()) {
+            throw std::runtime_error("Search text must not be empty.");
+        }
+
+        std::unique_ptr<DfaRegex> regex(useRegex ? new DfaRegex(pattern) : nullptr);
+        std::vector<SearchMatch> matches;
+        std::string rewritten;
+        std::string scratch;
+        size_t replaced = 0;
+
+        for (size_t i = 0; i < array.size(); i++) {
+            if (regex && !regex->mayMatch(array.data(i), array.length(i))) {
+                continue;
+            }
+            const std::string& line = array.fetch(i, scratch);
+            matches.clear();
+            if (regex) {
+                regex->findAll(line, i + 1, matches);
+            } else {
+                findLiteral(line, i + 1, pattern, matches);
+            }
+            if (matches.empty()) {
+                continue;
+            }
+
+            rewritten.clear();
+            size_t copied = 0;
+            for (size_t j = 0; j < matches.size(); j++) {
+                rewritten.append(line, copied, matches[j].column - copied);
+                rewritten += replacement;
+                copied = matches[j].column + matches[j].length;
+            }
+            rewritten.append(line, copied, std::string::npos);
+
+            changedLines.push_back(i);
+            contents.push_back(rewritten);
+            replaced += matches.size();
+        }
+
+        return replaced;
+    }
+
+    // Searches files straight from disk in fixed-size blocks without building a StringArray.
+    // The unfinished last line of each block is carried over to the next read, and
+    // every file is scanned by a single worker thread. Each file's result is handed to
+    // report, in the order the files were given, as soon as it and every file before it
+    // are done; report calls never overlap.
+    static void searchFilesOnDisk(const std::vector<std::string>& fileNames, const std::string& pattern, bool useRegex,
+                                  const std::function<void(const GrepResult&)>& report) {
+        TraceSpan span("SearchFunctions::searchFilesOnDisk");
+        if (pattern.empty()) {
+            throw std::runtime_error("Search text must not be empty.");
+        }
+        if (useRegex) {
+            DfaRegex validate(pattern);
+        }
+
+        std::vector<GrepResult> results(fileNames.size());
+        std::vector<char> finished(fileNames.size(), 0);
+        size_t reported = 0;
+        std::mutex reportMutex;
+        std::atomic<size_t> nextFile(0);
+        size_t workerCount = std::min<size_t>(fileNames.size(), std::max(1u, std::thread::hardware_concurrency()));
+        std::vector<std::thread> workers;
+
+        for (size_t i = 0; i < workerCount; i++) {
+            workers.push_back(std::thread([&]() {
+                for (size_t file = nextFile++; file < fileNames.size(); file = nextFile++) {
+                    results[file].fileName = fileNames[file];
+                    searchFileOnDisk(pattern, useRegex, results[file]);
+
+                    std::lock_guard<std::mutex> lock(reportMutex);
+                    finished[file] = 1;
+                    while (reported < results.size() && finished[reported]) {
+                        report(results[reported]);
+                        std::vector<GrepMatch>().swap(results[reported].matches);
+                        reported++;
+                    }
+                }
+            }));
+        }
+        for (size_t i = 0; i < workers.size(); i++) {
+            workers[i].join();
+        }
+    }
+
+    // Prints one file's matches, reading each matching line back from the file; returns
+    // the match count.
+    static size_t printGrepResult(const GrepResult& result) {
+        if (!result.error.empty()) {
+            std::cerr << result.fileName << ": " << result.error << std::endl;
+            return 0;
+        }
+
+        std::ifstream file(result.fileName, std::ios::binary);
+        std::string line;
+        unsigned long long lineOffset = std::numeric_limits<unsigned long long>::max();
+        for (size_t i = 0; i < result.matches.size(); i++) {
+            const GrepMatch& found = result.matches[i];
+            if (found.lineOffset != lineOffset) {
+                lineOffset = found.lineOffset;
+                line.assign(found.lineLength, '\0');
+                file.clear();
+                file.seekg(static_cast<std::streamoff>(lineOffset));
+                if (!line.empty() && !file.read(&line[0], line.size())) {
+                    line.clear();
+                }
+            }
+            std::cout << result.fileName << ":" << found.match.line << ":" << found.match.column << ": " << line << std::endl;
+        }
+        std::cout << result.fileName << ": " << result.matches.size() << " match(es)" << std::endl;
+        return result.matches.size();
+    }
+
+    static std::vector<PatternMatch> searchPatternsInArray(const ArenaLineStore& array, const AhoCorasick& automaton) {
+        TraceSpan span("SearchFunctions::searchPatternsInArray");
+        std::vector<PatternMatch> matches;
+        std::string scratch;
+
+        for (size_t i = 0; i < array.size(); i++) {
+            automaton.findAll(array.fetch(i, scratch), i + 1, matches);
+        }
+        return matches;
+    }
+
+    static void printPatternMatches(const AhoCorasick& automaton, const std::vector<PatternMatch>& matches) {
+        const std::vector<std::string>& patterns = automaton.getPatterns();
+        std::vector<size_t> counts(patterns.size(), 0);
+
+        for (size_t i = 0; i < matches.size(); i++) {
+            const PatternMatch& found = matches[i];
+            std::cout << "Pattern found in line " << found.match.line << " at position " << found.match.column
+                      << ": " << patterns[found.pattern] << std::endl;
+            counts[found.pattern]++;
+        }
+
+        std::cout << "Matches per pattern:" << std::endl;
+        for (size_t i = 0; i < patterns.size(); i++) {
+            std::cout << patterns[i] << ": " << counts[i] << std::endl;
+        }
+        std::cout << "Total matches: " << matches.size() << std::endl;
+    }
+};
+
+// Remembers the first occurrence per line for recently searched substrings. A repeated
+// query only rescans the lines StringArray reports as edited since the cached revision.
+class SearchCache {
+public:
+    SearchCache() : useCounter(0) {}
+
+    const std::map<size_t, size_t>& search(const StringArray& stringArray, const std::string& substring) {
+        TraceSpan span("SearchCache::search");
+        std::map<std::string, Entry>::iterator it = entries.find(substring);
+        if (it == entries.end()) {
+            if (entries.size() >= kMaxEntries) {
+                evictLeastRecentlyUsed();
+            }
+            it = entries.insert(std::make_pair(substring, Entry())).first;
+            rescanAll(stringArray, substring, it->second);
+        } else if (it->second.revision != stringArray.getRevision()) {
+            std::vector<StringArray::LineEdit> edits;
+            if (stringArray.editsSince(it->second.revision, edits)) {
+                rescanEdited(stringArray, substring, edits, it->second);
+            } else {
+                rescanAll(stringArray, substring, it->second);
+            }
+        }
+
+        it->second.lastUsed = ++useCounter;
+        return it->second.hits;
+    }
+
+private:
+    enum { kMaxEntries = 16 };
+
+    struct Entry {
+        Entry() : revision(0), lastUsed(0) {}
+
+        unsigned long long revision;
+        unsigned long long lastUsed;
+        std::map<size_t, size_t> hits;
+    };
+
+    std::map<std::string, Entry> entries;
+    unsigned long long useCounter;
+
+    void rescanAll(const StringArray& stringArray, const std::string& substring, Entry& entry) {
+        const ArenaLineStore& array = stringArray.getLines();
+        std::string scratch;
+        entry.hits.clear();
+        for (size_t i = 0; i < array.size(); i++) {
+            size_t found = array.fetch(i, scratch).find(substring);
+            if (found != std::string::npos) {
+                entry.hits.insert(entry.hits.end(), std::make_pair(i, found));
+            }
+        }
+        entry.revision = stringArray.getRevision();
+    }
+
+    void rescanLines(const StringArray& stringArray, const std::string& substring, const std::vector<size_t>& lines, Entry& entry) {
+        const ArenaLineStore& array = stringArray.getLines();
+        std::string scratch;
+        for (size_t i = 0; i < lines.size(); i++) {
+            size_t found = array.fetch(lines[i], scratch).find(substring);
+            if (found != std::string::npos) {
+                entry.hits[lines[i]] = found;
+            } else {
+                entry.hits.erase(lines[i]);
+            }
+        }
+        entry.revision = stringArray.getRevision();
+    }
+
+    // Renumbers the cached hits past each inserted or erased line, then rescans the lines
+    // that changed or were inserted, by their final numbers.
+    void rescanEdited(const StringArray& stringArray, const std::string& substring,
+                      const std::vector<StringArray::LineEdit>& edits, Entry& entry) {
+        const size_t erased = std::numeric_limits<size_t>::max();
+        std::vector<size_t> lines;
+        for (size_t i = 0; i < edits.size(); i++) {
+            size_t index = edits[i].index;
+            if (edits[i].kind == StringArray::LineEdit::kChanged) {
+                lines.push_back(index);
+                continue;
+            }
+            bool inserted = edits[i].kind == StringArray::LineEdit::kInserted;
+            shiftHits(entry.hits, index, inserted);
+            for (size_t j = 0; j < lines.size(); j++) {
+                if (lines[j] == erased || lines[j] < index) {
+                    continue;
+                }
+                lines[j] = inserted ? lines[j] + 1 : lines[j] == index ? erased : lines[j] - 1;
+            }
+            if (inserted) {
+                lines.push_back(index);
+            }
+        }
+        lines.erase(std::remove(lines.begin(), lines.end(), erased), lines.end());
+        std::sort(lines.begin(), lines.end());
+        lines.erase(std::unique(lines.begin(), lines.end()), lines.end());
+        rescanLines(stringArray, substring, lines, entry);
+    }
+
+    static void shiftHits(std::map<size_t, size_t>& hits, size_t index, bool inserted) {
+        std::map<size_t, size_t>::iterator first = hits.lower_bound(index);
+        std::vector<std::pair<size_t, size_t>> moved(first, hits.end());
+        hits.erase(first, hits.end());
+        for (size_t i = 0; i < moved.size(); i++) {
+            if (inserted) {
+                hits.insert(hits.end(), std::make_pair(moved[i].first + 1, moved[i].second));
+            } else if (moved[i].first != index) {
+                hits.insert(hits.end(), std::make_pair(moved[i].first - 1, moved[i].second));
+            }
+        }
+    }
+
+    void evictLeastRecentlyUsed() {
+        std::map<std::string, Entry>::iterator oldest = entries.begin();
+        for (std::map<std::string, Entry>::iterator it = entries.begin(); it != entries.end(); ++it) {
+            if (it->second.lastUsed < oldest->second.lastUsed) {
+                oldest = it;
+            }
+        }
+        entries.erase(oldest);
+    }
+};
+
+// Shows one screen of the document at a time. Rendering cost depends on the page size,
+// since only the visible lines are formatted and they go out in a single write.
+class PagedViewer {
+public:
+    explicit PagedViewer(const StringArray& stringArray) : stringArray(stringArray), firstLine(0) {
+        pageSize = terminalHeight() > 2 ? terminalHeight() - 2 : 1;
+    }
+
+    size_t getPageSize() const {
+        return pageSize;
+    }
+
+    void setPageSize(size_t lines) {
+        pageSize = std::max<size_t>(1, lines);
+    }
+
+    void render() {
+        clampFirstLine();
+        stringArray.renderLines(firstLine, pageSize, frame);
+        size_t total = stringArray.getStringCount();
+        size_t last = std::min(total, firstLine + pageSize);
+        frame += "-- lines " + std::to_string(total == 0 ? 0 : firstLine + 1) + "-" + std::to_string(last) +
+                 " of " + std::to_string(total) + " --\n";
+        writeAll(frame);
+    }
+
+    void pageDown() {
+        firstLine += pageSize;
+        clampFirstLine();
+    }
+
+    void pageUp() {
+        firstLine = firstLine > pageSize ? firstLine - pageSize : 0;
+    }
+
+    void jumpToLine(size_t lineIndex) {
+        firstLine = lineIndex > 0 ? lineIndex - 1 : 0;
+        clampFirstLine();
+    }
+
+private:
+    const StringArray& stringArray;
+    size_t firstLine;
+    size_t pageSize;
+    std::string frame;
+
+    void clampFirstLine() {
+        size_t total = stringArray.getStringCount();
+        if (firstLine >= total) {
+            firstLine = total > pageSize ? total - pageSize : 0;
+        }
+    }
+
+    static size_t terminalHeight() {
+        struct winsize size;
+        if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) == 0 && size.ws_row > 0) {
+            return size.ws_row;
+        }
+        return 24;
+    }
+
+    static void writeAll(const std::string& data) {
+        std::cout.flush();
+        size_t written = 0;
+        while (written < data.size()) {
+            ssize_t result = write(STDOUT_FILENO, data.data() + written, data.size() - written);
+            if (result <= 0) {
+                break;
+            }
+            written += static_cast<size_t>(result);
+        }
+    }
+};
+
+// Full-screen editor on a raw-mode terminal. The rows currently on screen are kept in a
+// model, and each frame only rewrites the changed tail of rows that differ from it.
+class ScreenEditor {
+public:
+    explicit ScreenEditor(StringArray& stringArray)
+        : stringArray(stringArray), cursorLine(0), cursorColumn(0), topLine(0), leftColumn(0),
+          shownTopLine(0), rows(0), columns(0), rawMode(false), running(true) {}
+
+    ~ScreenEditor() {
+        leaveRawMode();
+    }
+
+    void run() {
+        if (!enterRawMode()) {
+            std::cerr << "Full-screen mode needs an interactive terminal." << std::endl;
+            return;
+        }
+
+        status = "Ctrl-Q quit | Ctrl-Z undo | Ctrl-Y redo";
+        while (running) {
+            refresh();
+            handleKey(readKey());
+        }
+        stringArray.endEditGroup();
+        leaveRawMode();
+    }
+
+private:
+    enum Key {
+        KeyNone = -1,
+        KeyUp = 1000, KeyDown, KeyLeft, KeyRight, KeyPageUp, KeyPageDown, KeyHome, KeyEnd, KeyDelete
+    };
+
+    // The rest of an escape sequence arrives together with the ESC; a lone ESC does not.
+    enum { kEscapeTimeoutMs = 50 };
+
+    StringArray& stringArray;
+    size_t cursorLine;
+    size_t cursorColumn;
+    size_t topLine;
+    size_t leftColumn;
+    size_t shownTopLine;
+    size_t rows;
+    size_t columns;
+    bool rawMode;
+    bool running;
+    struct termios originalTermios;
+    std::vector<std::string> shownRows;
+    std::string status;
+    std::string frame;
+
+    bool enterRawMode() {
+        if (!isatty(STDIN_FILENO) || tcgetattr(STDIN_FILENO, &originalTermios) == -1) {
+            return false;
+        }
+
+        struct termios raw = originalTermios;
+        raw.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
+        raw.c_oflag &= ~(OPOST);
+        raw.c_cflag |= CS8;
+        raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
+        raw.c_cc[VMIN] = 1;
+        raw.c_cc[VTIME] = 0;
+        if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1) {
+            return false;
+        }
+
+        rawMode = true;
+        std::cout.flush();
+        writeAll("\x1b[?1049h\x1b[2J");
+        return true;
+    }
+
+    void leaveRawMode() {
+        if (rawMode) {
+            writeAll("\x1b[?1049l");
+            tcsetattr(STDIN_FILENO, TCSAFLUSH, &originalTermios);
+            rawMode = false;
+        }
+    }
+
+    void updateSize() {
+        struct winsize size;
+        size_t newRows = 24, newColumns = 80;
+        if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) == 0 && size.ws_row > 1 && size.ws_col > 0) {
+            newRows = size.ws_row;
+            newColumns = size.ws_col;
+        }
+
+        if (newRows != rows || newColumns != columns) {
+            rows = newRows;
+            columns = newColumns;
+            shownRows.assign(rows, std::string());
+            frame += "\x1b[2J";
+        }
+    }
+
+    size_t lineLength(size_t line) const {
+        return line < stringArray.getStringCount() ? stringArray.getLines().length(line) : 0;
+    }
+
+    void scrollToCursor() {
+        size_t textRows = rows - 1;
+        if (cursorLine < topLine) {
+            topLine = cursorLine;
+        } else if (cursorLine >= topLine + textRows) {
+            topLine = cursorLine - textRows + 1;
+        }
+
+        size_t textColumns = columns > gutterWidth() ? columns - gutterWidth() : 1;
+        if (cursorColumn < leftColumn) {
+            leftColumn = cursorColumn;
+        } else if (cursorColumn >= leftColumn + textColumns) {
+            leftColumn = cursorColumn - textColumns + 1;
+        }
+    }
+
+    size_t gutterWidth() const {
+        return std::to_string(std::max<size_t>(1, stringArray.getStringCount())).size() + 2;
+    }
+
+    std::string buildRow(size_t row) const {
+        const ArenaLineStore& lines = stringArray.getLines();
+        size_t gutter = gutterWidth();
+        if (row == rows - 1) {
+            std::string bar = status + " | line " + std::to_string(cursorLine + 1) + "/" +
+                              std::to_string(lines.size()) + ", column " + std::to_string(cursorColumn);
+            bar.resize(std::min(bar.size(), columns));
+            return "\x1b[7m" + bar + std::string(columns - bar.size(), ' ') + "\x1b[0m";
+        }
+
+        size_t line = topLine + row;
+        if (line >= lines.size()) {
+            return "~";
+        }
+
+        std::string number = std::to_string(line + 1);
+        std::string text = std::string(gutter - 2 - number.size(), ' ') + number + ": ";
+        const char* content = lines.data(line);
+        size_t contentLength = lines.length(line);
+        if (leftColumn < contentLength && columns > gutter) {
+            size_t visible = std::min(contentLength - leftColumn, columns - gutter);
+            for (size_t i = 0; i < visible; i++) {
+                unsigned char c = static_cast<unsigned char>(content[leftColumn + i]);
+                text += (c < 32 || c == 127) ? ' ' : static_cast<char>(c);
+            }
+        }
+        text.resize(std::min(text.size(), columns));
+        return text;
+    }
+
+    // Moves the text rows with the terminal's own scrolling so that a small scroll only
+    // costs the newly exposed rows instead of a full repaint.
+    void scrollShownRows() {
+        size_t textRows = rows - 1;
+        size_t distance = topLine > shownTopLine ? topLine - shownTopLine : shownTopLine - topLine;
+        if (distance == 0 || distance >= textRows) {
+            shownTopLine = topLine;
+            return;
+        }
+
+        frame += "\x1b[1;" + std::to_string(textRows) + "r";
+        if (topLine > shownTopLine) {
+            frame += "\x1b[" + std::to_string(distance) + "S";
+            shownRows.erase(shownRows.begin(), shownRows.begin() + distance);
+            shownRows.insert(shownRows.begin() + (textRows - distance), distance, std::string());
+        } else {
+            frame += "\x1b[" + std::to_string(distance) + "T";
+            shownRows.erase(shownRows.begin() + (textRows - distance), shownRows.begin() + textRows);
+            shownRows.insert(shownRows.begin(), distance, std::string());
+        }
+        frame += "\x1b[r";
+        shownTopLine = topLine;
+    }
+
+    void refresh() {
+        updateSize();
+        scrollToCursor();
+        scrollShownRows();
+
+        for (size_t row = 0; row < rows; row++) {
+            std::string wanted = buildRow(row);
+            std::string& shown = shownRows[row];
+            if (wanted == shown) {
+                continue;
+            }
+
+            size_t common = 0;
+            size_t limit = std::min(wanted.size(), shown.size());
+            while (common < limit && wanted[common] == shown[common]) {
+                common++;
+            }
+            // Escape sequences in the status bar do not map to columns, so it is redrawn whole.
+            if (row == rows - 1) {
+                common = 0;
+            }
+
+            frame += "\x1b[" + std::to_string(row + 1) + ";" + std::to_string(common + 1) + "H";
+            frame.append(wanted, common, std::string::npos);
+            if (wanted.size() < shown.size()) {
+                frame += "\x1b[K";
+            }
+            shown.swap(wanted);
+        }
+
+        frame += "\x1b[" + std::to_string(cursorLine - topLine + 1) + ";" +
+                 std::to_string(cursorColumn - leftColumn + gutterWidth() + 1) + "H";
+        writeAll(frame);
+        frame.clear();
+    }
+
+    int readKey() {
+        char c;
+        if (read(STDIN_FILENO, &c, 1) != 1) {
+            running = false;
+            return KeyNone;
+        }
+        if (c != '\x1b') {
+            return static_cast<unsigned char>(c);
+        }
+
+        char sequence[3];
+        if (!readSequenceByte(sequence[0]) || !readSequenceByte(sequence[1])) {
+            return '\x1b';
+        }
+        if (sequence[0] == '[' && sequence[1] >= '0' && sequence[1] <= '9') {
+            if (!readSequenceByte(sequence[2]) || sequence[2] != '~') {
+                return '\x1b';
+            }
+            switch (sequence[1]) {
+                case '1': case '7': return KeyHome;
+                case '3': return KeyDelete;
+                case '4': case '8': return KeyEnd;
+                case '5': return KeyPageUp;
+                case '6': return KeyPageDown;
+            }
+            return '\x1b';
+        }
+        if (sequence[0] == '[' || sequence[0] == 'O') {
+            switch (sequence[1]) {
+                case 'A': return KeyUp;
+                case 'B': return KeyDown;
+                case 'C': return KeyRight;
+                case 'D': return KeyLeft;
+                case 'H': return KeyHome;
+                case 'F': return KeyEnd;
+            }
+        }
+        return '\x1b';
+    }
+
+    static bool readSequenceByte(char& c) {
+        struct pollfd input = {STDIN_FILENO, POLLIN, 0};
+        return poll(&input, 1, kEscapeTimeoutMs) == 1 && read(STDIN_FILENO, &c, 1) == 1;
+    }
+
+    void handleKey(int key) {
+        size_t lineCount = stringArray.getStringCount();
+        int line = static_cast<int>(cursorLine) + 1;
+        int column = static_cast<int>(cursorColumn);
+
+        // A run of typing is one undo step; any other key ends it.
+        if (key == '\r' || key == KeyDelete || (key >= 32 && key < 256) || key == 8) {
+            stringArray.beginEditGroup();
+        } else {
+            stringArray.endEditGroup();
+        }
+
+        switch (key) {
+            case KeyNone:
+                return;
+            case 17:
+                running = false;
+                return;
+            case 26:
+                stringArray.undo();
+                break;
+            case 25:
+                stringArray.redo();
+                break;
+            case KeyUp:
+                cursorLine = cursorLine > 0 ? cursorLine - 1 : 0;
+                break;
+            case KeyDown:
+                cursorLine++;
+                break;
+            case KeyPageUp:
+                cursorLine = cursorLine > rows - 1 ? cursorLine - (rows - 1) : 0;
+                break;
+            case KeyPageDown:
+                cursorLine += rows - 1;
+                break;
+            case KeyLeft:
+                if (cursorColumn > 0) {
+                    cursorColumn--;
+                } else if (cursorLine > 0) {
+                    cursorLine--;
+                    cursorColumn = lineLength(cursorLine);
+                }
+                break;
+            case KeyRight:
+                if (cursorColumn < lineLength(cursorLine)) {
+                    cursorColumn++;
+                } else if (cursorLine + 1 < lineCount) {
+                    cursorLine++;
+                    cursorColumn = 0;
+                }
+                break;
+            case KeyHome:
+                cursorColumn = 0;
+                break;
+            case KeyEnd:
+                cursorColumn = lineLength(cursorLine);
+                break;
+            case '\r':
+                if (lineCount == 0) {
+                    stringArray.addEmptyLine();
+                }
+                stringArray.splitLine(line, column);
+                cursorLine++;
+                cursorColumn = 0;
+                break;
+            case 127:
+            case 8:
+                if (cursorColumn > 0) {
+                    stringArray.eraseSubstring(line, column - 1, 1);
+                    cursorColumn--;
+                } else if (cursorLine > 0) {
+                    cursorColumn = lineLength(cursorLine - 1);
+                    stringArray.joinWithNext(line - 1);
+                    cursorLine--;
+                }
+                break;
+            case KeyDelete:
+                if (cursorColumn < lineLength(cursorLine)) {
+                    stringArray.eraseSubstring(line, column, 1);
+                } else if (cursorLine + 1 < lineCount) {
+                    stringArray.joinWithNext(line);
+                }
+                break;
+            default:
+                if (key >= 32 && key < 256 && key != 127) {
+                    if (lineCount == 0) {
+                        stringArray.addEmptyLine();
+                    }
+                    stringArray.insertSubstring(line, column, std::string(1, static_cast<char>(key)));
+                    cursorColumn++;
+                }
+                break;
+        }
+
+        lineCount = stringArray.getStringCount();
+        if (cursorLine >= lineCount) {
+            cursorLine = lineCount > 0 ? lineCount - 1 : 0;
+        }
+        cursorColumn = std::min(cursorColumn, lineLength(cursorLine));
+    }
+
+    static void writeAll(const std::string& data) {
+        size_t written = 0;
+        while (written < data.size()) {
+            ssize_t result = write(STDOUT_FILENO, data.data() + written, data.size() - written);
+            if (result <= 0) {
+                break;
+            }
+            written += static_cast<size_t>(result);
+        }
+    }
+};
+
+class FilesSL {
+public:
+    static bool saveToFile(const std::string& fileName, const ArenaLineStore& data, bool report = true) {
+        TraceSpan span("FilesSL::saveToFile");
+        std::ofstream file(fileName);
+        if (file.is_open()) {
+            for (size_t i = 0; i < data.size(); i++) {
+                file.write(data.data(i), data.length(i));
+                file << '\n';
+            }
+            file.close();
+            if (report) {
+                std::cout << "Array saved to " << fileName << std::endl;
+            }
+            return true;
+        } else {
+            if (report) {
+                std::cerr << "Error opening the file." << std::endl;
+            }
+            return false;
+        }
+    }
+
+    // Writes a pinned version to a temporary file next to the target and renames it into
+    // place, so readers of fileName see either the old or the complete new contents.
+    // Returns false with the temporary file removed when the save fails or is cancelled.
+    static bool saveVersionToFile(const std::string& fileName, const DocumentVersion& version,
+                                  std::atomic<size_t>& linesWritten, const std::atomic<bool>& cancelRequested,
+                                  std::string& error) {
+        TraceSpan span("FilesSL::saveVersionToFile");
+        std::string tempName = fileName + ".tmp" + std::to_string(getpid());
+        int fd = open(tempName.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd == -1) {
+            error = "Error opening the file.";
+            return false;
+        }
+        // The rename replaces the file, so carry its permission bits over to the new one.
+        struct stat original;
+        if (stat(fileName.c_str(), &original) == 0) {
+            fchmod(fd, original.st_mode & 07777);
+        }
+
+        const size_t bufferSize = 1 << 20;
+        std::string buffer;
+        buffer.reserve(bufferSize + 4096);
+        bool success = true;
+
+        for (size_t i = 0; i < version.getLineCount() && success; i++) {
+            buffer.append(version.data(i), version.length(i));
+            buffer += '\n';
+            if (buffer.size() >= bufferSize || i + 1 == version.getLineCount()) {
+                TraceSpan writeSpan("FilesSL::saveVersionToFile write");
+                success = writeAll(fd, buffer);
+                buffer.clear();
+                linesWritten = i + 1;
+                if (cancelRequested) {
+                    error = "Save cancelled.";
+                    success = false;
+                }
+            }
+        }
+        if (!success && error.empty()) {
+            error = "Error writing the file.";
+        }
+
+        if (success) {
+            TraceSpan fsyncSpan("FilesSL::saveVersionToFile fsync");
+            if (fsync(fd) == -1) {
+                error = "Error flushing the file.";
+                success = false;
+            }
+        }
+        close(fd);
+
+        if (success && rename(tempName.c_str(), fileName.c_str()) == -1) {
+            error = "Error replacing the file.";
+            success = false;
+        }
+        if (!success) {
+            unlink(tempName.c_str());
+            return false;
+        }
+        if (!syncDirectoryOf(fileName)) {
+            error = "Error flushing the directory.";
+            return false;
+        }
+        return true;
+    }
+
+    // Flushes the directory entry of fileName, which makes a rename into it durable.
+    static bool syncDirectoryOf(const std::string& fileName) {
+        size_t slash = fileName.find_last_of('/');
+        std::string directory = slash == std::string::npos ? "." : slash == 0 ? "/" : fileName.substr(0, slash);
+        int fd = open(directory.c_str(), O_RDONLY);
+        if (fd == -1) {
+            return false;
+        }
+        bool synced = fsync(fd) == 0;
+        close(fd);
+        return synced;
+    }
+
+    // Saves by overwriting only the lines edited since the document was last saved to or
+    // loaded from fileName. This works when no line changed its length and the file on
+    // disk still matches the recorded layout; otherwise it returns false and writes nothing.
+    // A failed write or sync also returns false, but may leave the file partially patched,
+    // so the caller must then rewrite it in full, as save() does.
+    static bool patchChangedLines(const std::string& fileName, const StringArray& stringArray, size_t& patchedLines) {
+        TraceSpan span("FilesSL::patchChangedLines");
+        const SavedLayout& layout = stringArray.getSavedLayout();
+        const ArenaLineStore& array = stringArray.getLines();
+        std::vector<size_t> dirty;
+        patchedLines = 0;
+
+        if (layout.fileName != fileName || layout.lineOffsets.size() != array.size() + 1 ||
+            !stringArray.dirtyLinesSinceSave(dirty)) {
+            return false;
+        }
+        for (size_t i = 0; i < dirty.size(); i++) {
+            if (layout.lineOffsets[dirty[i] + 1] - layout.lineOffsets[dirty[i]] != array.length(dirty[i]) + 1) {
+                return false;
+            }
+        }
+
+        // Checked on the opened descriptor, so the file cannot be swapped in between.
+        int fd = open(fileName.c_str(), O_WRONLY);
+        if (fd == -1) {
+            return false;
+        }
+        struct stat info;
+        if (fstat(fd, &info) != 0 || !layout.matches(info)) {
+            close(fd);
+            return false;
+        }
+
+        std::string buffer;
+        bool success = true;
+        for (size_t i = 0; i < dirty.size() && success; ) {
+            size_t first = dirty[i];
+            size_t last = first;
+            buffer.clear();
+            while (i < dirty.size() && dirty[i] == last) {
+                buffer.append(array.data(last), array.length(last));
+                buffer += '\n';
+                last++;
+                i++;
+            }
+            TraceSpan writeSpan("FilesSL::patchChangedLines pwrite");
+            success = pwriteAll(fd, buffer, layout.lineOffsets[first]);
+        }
+        if (success) {
+            TraceSpan fsyncSpan("FilesSL::patchChangedLines fsync");
+            success = fsync(fd) == 0;
+        }
+        close(fd);
+
+        if (success) {
+            patchedLines = dirty.size();
+        }
+        return success;
+    }
+
+    // Reads the whole file into a single arena and indexes its lines in place, so loading
+    // does not allocate per line.
+    static bool loadIntoStore(const std::string& fileName, ArenaLineStore& store, bool report = true) {
+        TraceSpan span("FilesSL::loadIntoStore");
+        store.clear();
+        int fd = open(fileName.c_str(), O_RDONLY);
+        struct stat info;
+        if (fd == -1 || fstat(fd, &info) != 0) {
+            if (fd != -1) {
+                close(fd);
+            }
+            if (report) {
+                std::cerr << "Error opening the file." << std::endl;
+            }
+            return false;
+        }
+
+        std::vector<char> image(static_cast<size_t>(info.st_size));
+        size_t filled = 0;
+        TraceSpan readSpan("FilesSL::loadIntoStore read");
+        while (filled < image.size()) {
+            ssize_t result = read(fd, &image[filled], image.size() - filled);
+            if (result == -1 && errno == EINTR) {
+                continue;
+            }
+            if (result <= 0) {
+                break;
+            }
+            filled += static_cast<size_t>(result);
+        }
+        close(fd);
+        image.resize(filled);
+        readSpan.finish();
+
+        store.assignFileImage(image);
+        if (report) {
+            std::cout << "Array loaded from " << fileName << std::endl;
+        }
+        return true;
+    }
+
+    static std::vector<std::string> loadFromFile(const std::string& fileName) {
+        std::vector<std::string> loadedData;
+        std::ifstream file(fileName);
+        if (file.is_open()) {
+            std::string line;
+            while (std::getline(file, line)) {
+                loadedData.push_back(line);
+            }
+            file.close();
+            std::cout << "Array loaded from " << fileName << std::endl;
+        } else {
+            std::cerr << "Error opening the file." << std::endl;
+        }
+        return loadedData;
+    }
+
+private:
+    static bool pwriteAll(int fd, const std::string& data, unsigned long long offset) {
+        size_t written = 0;
+        while (written < data.size()) {
+            ssize_t result = pwrite(fd, data.data() + written, data.size() - written, static_cast<off_t>(offset + written));
+            if (result == -1 && errno == EINTR) {
+                continue;
+            }
+            if (result <= 0) {
+                return false;
+            }
+            written += static_cast<size_t>(result);
+        }
+        return true;
+    }
+
+    static bool writeAll(int fd, const std::string& data) {
+        size_t written = 0;
+        while (written < data.size()) {
+            ssize_t result = write(fd, data.data() + written, data.size() - written);
+            if (result == -1 && errno == EINTR) {
+                continue;
+            }
+            if (result <= 0) {
+                return false;
+            }
+            written += static_cast<size_t>(result);
+        }
+        return true;
+    }
+};
+
+class IReader {
+public:
+    virtual ~IReader() {}
+    virtual std::string Read(const std::string& filePath) = 0;
+};
+
+class FileReader : public IReader {
+public:
+    std::string Read(const std::string& filePath) override {
+        TraceSpan span("FileReader::Read");
+        std::ifstream file(filePath);
+        if (!file.is_open()) {
+            throw std::runtime_error("File not found.");
+        }
+
+        std::string content;
+        char buffer[128];
+        while (!file.eof()) {
+            file.read(buffer, sizeof(buffer));
+            content.append(buffer, file.gcount());
+        }
+        return content;
+    }
+};
+
+class IWriter {
+public:
+    virtual ~IWriter() {}
+    virtual void Write(const std::string& filePath, const std::string& content) = 0;
+};
+
+class FileWriter : public IWriter {
+public:
+    void Write(const std::string& filePath, const std::string& content) override {
+        TraceSpan span("FileWriter::Write");
+        std::ifstream file(filePath);
+        if (file.good()) {
+            throw std::runtime_error("File already exists.");
+        }
+
+        std::ofstream output(filePath, std::ios::binary);
+
+        if (!output.is_open()) {
+            throw std::runtime_error("Unable to open the file for writing.");
+        }
+
+        const size_t chunkSize = 128;
+        for (size_t i = 0; i < content.size(); i += chunkSize) {
+            size_t chunkEnd = std::min(i + chunkSize, content.size());
+            output.write(content.c_str() + i, chunkEnd - i);
+        }
+    }
+};
+
+class EncryptionLibrary {
+public:
+    EncryptionLibrary(const std::string &libraryPath) : encrypt_(nullptr), decrypt_(nullptr) {
+        library_ = dlopen(libraryPath.c_str(), RTLD_LAZY);
+        if (!library_) {
+            std::cerr << "Failed to load the library: " << dlerror() << std::endl;
+            return;
+        }
+
+        encrypt_ = (EncryptFunction)dlsym(library_, "encrypt");
+        decrypt_ = (DecryptFunction)dlsym(library_, "decrypt");
+
+        if (!encrypt_ || !decrypt_) {
+            std::cerr << "Failed to load functions: " << dlerror() << std::endl;
+        }
+    }
+
+    ~EncryptionLibrary() {
+        if (library_) {
+            dlclose(library_);
+        }
+    }
+
+    bool isLoaded() const {
+        return encrypt_ && decrypt_;
+    }
+
+    std::string encrypt(const std::string &inputText, const std::string &keyString) {
+        if (encrypt_) {
+            return encrypt_(inputText, keyString);
+        } else {
+            return "Encryption function not loaded";
+        }
+    }
+
+    std::string decrypt(const std::string &inputText, const std::string &keyString) {
+        if (decrypt_) {
+            return decrypt_(inputText, keyString);
+        } else {
+            return "Decryption function not loaded";
         }
     }
 
@@ -337,111 +4587,1069 @@ private:
     DecryptFunction decrypt_;
 };
 
-class RandomKeyGenerator {
+class RandomKeyGenerator {
+public:
+    RandomKeyGenerator() {
+        std::random_device rd;
+        generator_ = std::mt19937(rd());
+        distribution_ = std::uniform_int_distribution<int>(1, 100);
+    }
+
+    int GenerateRandomKey() {
+        return distribution_(generator_);
+    }
+
+private:
+    std::mt19937 generator_;
+    std::uniform_int_distribution<int> distribution_;
+};
+
+class EncryptionHandler {
+public:
+    EncryptionHandler(const char* libraryPath) : encryptionLibrary(libraryPath) {}
+
+    void process() {
+        int mode = 0;
+        std::cout << "Choose mode: 1 for Normal mode, 2 for Secret mode: ";
+        std::cin >> mode;
+
+        std::string inputFilePath, outputFilePath, key;
+
+        // Normal mode
+        if (mode == 1) {
+            std::string operation;
+            std::cout << "Choose operation: 'encrypt' or 'decrypt': ";
+            std::cin >> operation;
+
+            std::cout << "Enter input file path: ";
+            std::cin >> inputFilePath;
+
+            std::cout << "Enter output file path: ";
+            std::cin >> outputFilePath;
+
+            std::cout << "Enter the key: ";
+            std::cin >> key;
+
+            try {
+                IReader *reader = new FileReader();
+                IWriter *writer = new FileWriter();
+                std::string content = reader->Read(inputFilePath);
+                size_t inputBytes = content.capacity();
+
+                TraceSpan transformSpan("EncryptionHandler::transform");
+                if (operation == "encrypt") {
+                    content = encryptionLibrary.encrypt(content, key);
+                } else if (operation == "decrypt") {
+                    content = encryptionLibrary.decrypt(content, key);
+                } else {
+                    std::cerr << "Invalid operation. Please choose 'encrypt' or 'decrypt'." << std::endl;
+                }
+                transformSpan.finish();
+
+                // The input and output text are both alive while the library runs.
+                MemoryStats::update("encryption buffers", inputBytes + content.capacity());
+                writer->Write(outputFilePath, content);
+                std::cout << "Operation completed successfully." << std::endl;
+
+                delete reader;
+                delete writer;
+                encryptionLibrary.~EncryptionLibrary();
+            } catch (const std::exception &e) {
+                std::cerr << "Error: " << e.what() << std::endl;
+            }
+            MemoryStats::update("encryption buffers", 0);
+        // Secret mode
+        } else if (mode == 2) {
+            RandomKeyGenerator keyGenerator;
+
+            std::cout << "Enter input file path: ";
+            std::cin >> inputFilePath;
+
+            std::cout << "Enter output file path: ";
+            std::cin >> outputFilePath;
+
+            try {
+                IReader *reader = new FileReader();
+                IWriter *writer = new FileWriter();
+                std::string content = reader->Read(inputFilePath);
+                size_t inputBytes = content.capacity();
+
+                int randomKey = keyGenerator.GenerateRandomKey();
+
+                TraceSpan transformSpan("EncryptionHandler::transform");
+                content = encryptionLibrary.encrypt(content, std::to_string(randomKey));
+                transformSpan.finish();
+
+                // The input and output text are both alive while the library runs.
+                MemoryStats::update("encryption buffers", inputBytes + content.capacity());
+                writer->Write(outputFilePath, content);
+                std::cout << "Operation completed successfully." << std::endl;
+
+                delete reader;
+                delete writer;
+                encryptionLibrary.~EncryptionLibrary();
+            } catch (const std::exception &e) {
+                std::cerr << "Error: " << e.what() << std::endl;
+            }
+            MemoryStats::update("encryption buffers", 0);
+        }
+    }
+
+private:
+    EncryptionLibrary encryptionLibrary;
+};
+
+// Re-executes an edit trace against a fresh document as fast as possible. Prints one
+// tab-separated record per result: operation count, recorded and replay time, per-operation
+// latency and an FNV-1a checksum of the final text, so replays can be compared across builds.
+class TraceReplayer {
 public:
-    RandomKeyGenerator() {
-        std::random_device rd;
-        generator_ = std::mt19937(rd());
-        distribution_ = std::uniform_int_distribution<int>(1, 100);
+    explicit TraceReplayer(std::ostream& output) : output(output), histograms(EditTrace::kOpCount) {}
+
+    void run(const std::string& fileName) {
+        EditTraceReader reader(fileName);
+        StringArray stringArray;
+        SearchCache searchCache;
+        size_t operations = 0;
+        unsigned long long recordedMicros = 0;
+        std::chrono::steady_clock::duration replayTime = std::chrono::steady_clock::duration::zero();
+
+        int op = 0;
+        unsigned long long micros = 0;
+        while (reader.next(op, micros)) {
+            if (op <= 0 || op >= EditTrace::kOpCount) {
+                throw std::runtime_error("Unknown operation in edit trace.");
+            }
+            recordedMicros += micros;
+            operations++;
+
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            replay(reader, static_cast<EditTrace::Op>(op), stringArray, searchCache);
+            std::chrono::steady_clock::duration elapsed = std::chrono::steady_clock::now() - start;
+            replayTime += elapsed;
+            histograms[op].record(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count(), 0);
+        }
+
+        output << "ops\t" << operations << '\n';
+        output << "recorded_seconds\t" << recordedMicros / 1e6 << '\n';
+        output << "replay_seconds\t" << std::chrono::duration<double>(replayTime).count() << '\n';
+        for (int i = 1; i < EditTrace::kOpCount; i++) {
+            const LatencyHistogram& h = histograms[i];
+            if (h.getCount() > 0) {
+                output << "op\t" << EditTrace::opName(i) << '\t' << h.getCount() << '\t' << h.percentile(0.5) / 1000.0
+                       << '\t' << h.percentile(0.99) / 1000.0 << '\t' << h.getMaxNanoseconds() / 1000.0 << '\n';
+            }
+        }
+
+        char checksum[17];
+        snprintf(checksum, sizeof(checksum), "%016llx", documentChecksum(stringArray.getLines()));
+        output << "lines\t" << stringArray.getStringCount() << '\n';
+        output << "checksum\t" << checksum << std::endl;
     }
 
-    int GenerateRandomKey() {
-        return distribution_(generator_);
+    static unsigned long long documentChecksum(const ArenaLineStore& lines) {
+        unsigned long long hash = 0xCBF29CE484222325ULL;
+        for (size_t i = 0; i < lines.size(); i++) {
+            const char* data = lines.data(i);
+            for (size_t j = 0; j < lines.length(i); j++) {
+                hash = (hash ^ static_cast<unsigned char>(data[j])) * 0x100000001B3ULL;
+            }
+            hash = (hash ^ '\n') * 0x100000001B3ULL;
+        }
+        return hash;
     }
 
 private:
-    std::mt19937 generator_;
-    std::uniform_int_distribution<int> distribution_;
+    std::ostream& output;
+    std::vector<LatencyHistogram> histograms;
+    std::set<std::string> mismatchedFiles;
+
+    static int nextInt(EditTraceReader& reader) {
+        return static_cast<int>(reader.integer());
+    }
+
+    void replay(EditTraceReader& reader, EditTrace::Op op, StringArray& stringArray, SearchCache& searchCache) {
+        switch (op) {
+            case EditTrace::kAppend:
+                stringArray.addString(reader.text());
+                break;
+            case EditTrace::kEmptyLine:
+                stringArray.addEmptyLine();
+                break;
+            case EditTrace::kReplaceLines: {
+                size_t count = static_cast<size_t>(reader.integer());
+                std::vector<size_t> lineIndices(count);
+                std::vector<std::string> contents(count);
+                for (size_t i = 0; i < count; i++) {
+                    lineIndices[i] = static_cast<size_t>(reader.integer());
+                    contents[i] = reader.text();
+                }
+                stringArray.replaceLines(lineIndices, contents);
+                break;
+            }
+            case EditTrace::kDelete: {
+                int lineIndex = nextInt(reader), position = nextInt(reader), length = nextInt(reader);
+                stringArray.deleteSubstring(lineIndex, position, length);
+                break;
+            }
+            case EditTrace::kUndo:
+                stringArray.undo();
+                break;
+            case EditTrace::kRedo:
+                stringArray.redo();
+                break;
+            case EditTrace::kInsert: {
+                int lineIndex = nextInt(reader), position = nextInt(reader);
+                std::string substring = reader.text();
+                stringArray.insertSubstring(lineIndex, position, substring, reader.integer() != 0);
+                break;
+            }
+            case EditTrace::kCut: {
+                int lineIndex = nextInt(reader), position = nextInt(reader), length = nextInt(reader);
+                stringArray.cut(lineIndex, position, length);
+                break;
+            }
+            case EditTrace::kCopy: {
+                int lineIndex = nextInt(reader), position = nextInt(reader), length = nextInt(reader);
+                stringArray.copy(lineIndex, position, length);
+                break;
+            }
+            case EditTrace::kPaste: {
+                int lineIndex = nextInt(reader), position = nextInt(reader);
+                stringArray.paste(lineIndex, position);
+                break;
+            }
+            case EditTrace::kSplitLine: {
+                int lineIndex = nextInt(reader), position = nextInt(reader);
+                stringArray.splitLine(lineIndex, position);
+                break;
+            }
+            case EditTrace::kJoinLines:
+                stringArray.joinWithNext(nextInt(reader));
+                break;
+            case EditTrace::kErase: {
+                int lineIndex = nextInt(reader), position = nextInt(reader), length = nextInt(reader);
+                stringArray.eraseSubstring(lineIndex, position, length);
+                break;
+            }
+            case EditTrace::kBeginGroup:
+                stringArray.beginEditGroup();
+                break;
+            case EditTrace::kEndGroup:
+                stringArray.endEditGroup();
+                break;
+            // A failed load left the session with an empty document, and so does the replay.
+            case EditTrace::kLoad: {
+                std::string fileName = reader.text();
+                ArenaLineStore lines;
+                FilesSL::loadIntoStore(fileName, lines, false);
+                if (reader.getVersion() >= 2) {
+                    long long lineCount = reader.integer();
+                    unsigned long long checksum = static_cast<unsigned long long>(reader.integer());
+                    bool differs = static_cast<size_t>(lineCount) != lines.size() || checksum != documentChecksum(lines);
+                    if (differs && mismatchedFiles.insert(fileName).second) {
+                        std::cerr << "Warning: " << fileName << " is not the file the trace loaded; "
+                                  << "the replay will not match the session." << std::endl;
+                    }
+                }
+                stringArray.setLines(lines);
+                stringArray.markSaved(fileName);
+                break;
+            }
+            case EditTrace::kSearch:
+                searchCache.search(stringArray, reader.text());
+                break;
+            case EditTrace::kRegexSearch: {
+                std::string pattern = reader.text();
+                try {
+                    SearchFunctions::searchRegexInArray(stringArray.getLines(), pattern);
+                } catch (const std::exception &) {
+                    // The session reported the invalid pattern; replay just moves on.
+                }
+                break;
+            }
+            default:
+                break;
+        }
+    }
 };
 
-class EncryptionHandler {
+// Runs editing scripts without prompts. Each script line is one command whose
+// arguments are separated by single spaces; the last argument takes the rest of the line.
+// Every command answers with one tab-separated "ok" or "error" record on the output,
+// preceded by any "match" or "line" data records it produces.
+class BatchRunner {
 public:
-    EncryptionHandler(const char* libraryPath) : encryptionLibrary(libraryPath) {}
+    BatchRunner(StringArray& stringArray, std::ostream& output) : stringArray(stringArray), output(output), failures(0) {}
+
+    size_t run(std::istream& input) {
+        std::string line;
+        size_t lineNumber = 0;
+        while (std::getline(input, line)) {
+            lineNumber++;
+            if (!line.empty() && line[line.size() - 1] == '\r') {
+                line.erase(line.size() - 1);
+            }
+            if (line.empty() || line[0] == '#') {
+                continue;
+            }
+            execute(line, lineNumber);
+        }
+        output.flush();
+        return failures;
+    }
+
+private:
+    StringArray& stringArray;
+    std::ostream& output;
+    size_t failures;
+    std::vector<SearchMatch> matches;
+
+    // Splits off `count` space-separated fields; the remainder is stored as the last one.
+    static bool split(const std::string& text, size_t count, std::vector<std::string>& fields) {
+        fields.clear();
+        size_t start = 0;
+        for (size_t i = 0; i + 1 < count; i++) {
+            size_t space = text.find(' ', start);
+            if (space == std::string::npos) {
+                return false;
+            }
+            fields.push_back(text.substr(start, space - start));
+            start = space + 1;
+        }
+        if (count > 0) {
+            if (start > text.size()) {
+                return false;
+            }
+            fields.push_back(text.substr(start));
+        }
+        return true;
+    }
+
+    static bool toInt(const std::string& text, int& value) {
+        if (text.empty()) {
+            return false;
+        }
+        char* end = nullptr;
+        long parsed = strtol(text.c_str(), &end, 10);
+        if (*end != '\0' || parsed < std::numeric_limits<int>::min() || parsed > std::numeric_limits<int>::max()) {
+            return false;
+        }
+        value = static_cast<int>(parsed);
+        return true;
+    }
+
+    void ok(const std::string& command, const std::string& detail = std::string()) {
+        output << "ok\t" << command;
+        if (!detail.empty()) {
+            output << '\t' << detail;
+        }
+        output << '\n';
+    }
+
+    void fail(size_t lineNumber, const std::string& message) {
+        output << "error\t" << lineNumber << '\t' << message << '\n';
+        failures++;
+    }
+
+    void writeMatches(const std::vector<SearchMatch>& found) {
+        for (size_t i = 0; i < found.size(); i++) {
+            output << "match\t" << found[i].line << '\t' << found[i].column << '\t' << found[i].length << '\n';
+        }
+    }
+
+    void execute(const std::string& line, size_t lineNumber) {
+        size_t space = line.find(' ');
+        std::string command = line.substr(0, space);
+        std::string rest = space == std::string::npos ? std::string() : line.substr(space + 1);
+        std::vector<std::string> args;
+        int lineIndex = 0, position = 0, length = 0;
+
+        try {
+            if (command == "append") {
+                stringArray.addString(rest);
+                ok(command);
+            } else if (command == "newline") {
+                stringArray.addEmptyLine();
+                ok(command);
+            } else if (command == "insert" || command == "replace") {
+                if (!split(rest, 3, args) || !toInt(args[0], lineIndex) || !toInt(args[1], position)) {
+                    fail(lineNumber, "usage: " + command + " <line> <position> <text>");
+                } else if (stringArray.insertSubstring(lineIndex, position, args[2], command == "replace")) {
+                    ok(command);
+                } else {
+                    fail(lineNumber, "invalid line or position");
+                }
+            } else if (command == "delete" || command == "cut" || command == "copy") {
+                if (!split(rest, 3, args) || !toInt(args[0], lineIndex) || !toInt(args[1], position) || !toInt(args[2], length)) {
+                    fail(lineNumber, "usage: " + command + " <line> <position> <length>");
+                } else if (command == "delete" ? stringArray.deleteSubstring(lineIndex, position, length)
+                           : command == "cut" ? stringArray.cut(lineIndex, position, length)
+                           : stringArray.copy(lineIndex, position, length)) {
+                    ok(command);
+                } else {
+                    fail(lineNumber, "invalid line, position or length");
+                }
+            } else if (command == "paste") {
+                if (!split(rest, 2, args) || !toInt(args[0], lineIndex) || !toInt(args[1], position)) {
+                    fail(lineNumber, "usage: paste <line> <position>");
+                } else if (stringArray.paste(lineIndex, position)) {
+                    ok(command);
+                } else {
+                    fail(lineNumber, "invalid line or position");
+                }
+            } else if (command == "undo") {
+                ok(command, stringArray.undo() ? "1" : "0");
+            } else if (command == "redo") {
+                ok(command, stringArray.redo() ? "1" : "0");
+            } else if (command == "load") {
+                ArenaLineStore lines;
+                if (FilesSL::loadIntoStore(rest, lines, false)) {
+                    stringArray.setLines(lines);
+                    ok(command, std::to_string(stringArray.getStringCount()));
+                } else {
+                    fail(lineNumber, "cannot open " + rest);
+                }
+            } else if (command == "save") {
+                if (FilesSL::saveToFile(rest, stringArray.getLines(), false)) {
+                    ok(command);
+                } else {
+                    fail(lineNumber, "cannot open " + rest);
+                }
+            } else if (command == "search" || command == "regex") {
+                const ArenaLineStore& array = stringArray.getLines();
+                matches.clear();
+                if (command == "regex") {
+                    matches = SearchFunctions::searchRegexInArray(array, rest);
+                } else if (!rest.empty()) {
+                    std::string scratch;
+                    for (size_t i = 0; i < array.size(); i++) {
+                        SearchFunctions::findLiteral(array.fetch(i, scratch), i + 1, rest, matches);
+                    }
+                }
+                writeMatches(matches);
+                ok(command, std::to_string(matches.size()));
+            } else if (command == "replaceall" || command == "replaceregex") {
+                size_t tab = rest.find('\t');
+                if (tab == std::string::npos) {
+                    fail(lineNumber, "usage: " + command + " <pattern><TAB><replacement>");
+                } else {
+                    std::vector<size_t> changedLines;
+                    std::vector<std::string> contents;
+                    size_t replaced = SearchFunctions::replaceAllInArray(stringArray.getLines(), rest.substr(0, tab),
+                                                                         rest.substr(tab + 1), command == "replaceregex",
+                                                                         changedLines, contents);
+                    stringArray.replaceLines(changedLines, contents);
+                    ok(command, std::to_string(replaced));
+                }
+            } else if (command == "print") {
+                const ArenaLineStore& array = stringArray.getLines();
+                for (size_t i = 0; i < array.size(); i++) {
+                    output << "line\t" << i + 1 << '\t';
+                    output.write(array.data(i), array.length(i));
+                    output << '\n';
+                }
+                ok(command, std::to_string(array.size()));
+            } else if (command == "count") {
+                ok(command, std::to_string(stringArray.getStringCount()));
+            } else if (command == "stats") {
+                StringArray::Summary summary = stringArray.summarize();
+                ok(command, std::to_string(summary.lines) + '\t' + std::to_string(summary.words) + '\t' +
+                            std::to_string(summary.bytes) + '\t' + std::to_string(summary.chars) + '\t' +
+                            std::to_string(summary.longestLine));
+            } else if (command == "offset") {
+                size_t offset = 0;
+                if (!split(rest, 2, args) || !toInt(args[0], lineIndex) || !toInt(args[1], position)) {
+                    fail(lineNumber, "usage: offset <line> <position>");
+                } else if (lineIndex >= 1 && position >= 0 && stringArray.positionToOffset(lineIndex, position, offset)) {
+                    ok(command, std::to_string(offset));
+                } else {
+                    fail(lineNumber, "invalid line or position");
+                }
+            } else if (command == "locate") {
+                char* end = nullptr;
+                unsigned long long offset = strtoull(rest.c_str(), &end, 10);
+                size_t foundLine = 0, foundPosition = 0;
+                if (rest.empty() || *end != '\0' || rest[0] == '-') {
+                    fail(lineNumber, "usage: locate <offset>");
+                } else if (stringArray.offsetToPosition(offset, foundLine, foundPosition)) {
+                    ok(command, std::to_string(foundLine) + '\t' + std::to_string(foundPosition));
+                } else {
+                    fail(lineNumber, "invalid offset");
+                }
+            } else {
+                fail(lineNumber, "unknown command " + command);
+            }
+        } catch (const std::exception &e) {
+            fail(lineNumber, e.what());
+        }
+    }
+};
+
+#ifdef __linux__
+// Keeps documents resident and serves batch scripts over a Unix domain socket with a
+// single-threaded epoll loop, so requests for a document never interleave.
+// Request frame: u32 length, u16 document name length, name, batch script.
+// Response frame: u32 length, u32 failed command count, batch result records.
+// Integers are little-endian; lengths count the bytes that follow them.
+class EditorServer {
+public:
+    explicit EditorServer(const std::string& socketPath) : socketPath(socketPath), listenFd(-1), epollFd(-1) {}
+
+    ~EditorServer() {
+        for (std::map<int, Connection>::iterator it = connections.begin(); it != connections.end(); ++it) {
+            close(it->first);
+        }
+        if (listenFd != -1) {
+            close(listenFd);
+            unlink(socketPath.c_str());
+        }
+        if (epollFd != -1) {
+            close(epollFd);
+        }
+    }
+
+    void run() {
+        listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        if (listenFd == -1) {
+            throw std::runtime_error("Unable to create the socket.");
+        }
+
+        struct sockaddr_un address;
+        memset(&address, 0, sizeof(address));
+        address.sun_family = AF_UNIX;
+        if (socketPath.size() >= sizeof(address.sun_path)) {
+            throw std::runtime_error("Socket path is too long.");
+        }
+        strcpy(address.sun_path, socketPath.c_str());
+        unlink(socketPath.c_str());
+        if (bind(listenFd, reinterpret_cast<struct sockaddr*>(&address), sizeof(address)) == -1 || listen(listenFd, 128) == -1) {
+            throw std::runtime_error("Unable to listen on " + socketPath + ".");
+        }
+
+        epollFd = epoll_create1(0);
+        if (epollFd == -1) {
+            throw std::runtime_error("Unable to create the event loop.");
+        }
+        watch(listenFd, EPOLLIN, EPOLL_CTL_ADD);
+        std::cout << "Listening on " << socketPath << std::endl;
+
+        struct epoll_event events[64];
+        while (true) {
+            int count = epoll_wait(epollFd, events, 64, -1);
+            if (count == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw std::runtime_error("Event loop failed.");
+            }
+
+            for (int i = 0; i < count; i++) {
+                int fd = events[i].data.fd;
+                if (fd == listenFd) {
+                    acceptClients();
+                } else if (events[i].events & (EPOLLERR | EPOLLHUP) && !(events[i].events & EPOLLIN)) {
+                    dropClient(fd);
+                } else {
+                    bool open = !(events[i].events & EPOLLIN) || readClient(fd);
+                    if (!flushClient(fd) || !open) {
+                        dropClient(fd);
+                    }
+                }
+            }
+        }
+    }
+
+private:
+    enum { kMaxFrame = 64 * 1024 * 1024 };
+
+    struct Connection {
+        Connection() : sent(0) {}
+
+        std::string input;
+        std::string output;
+        size_t sent;
+    };
+
+    std::string socketPath;
+    int listenFd;
+    int epollFd;
+    std::map<int, Connection> connections;
+    std::map<std::string, StringArray> documents;
+
+    void watch(int fd, unsigned int events, int operation) {
+        struct epoll_event event;
+        memset(&event, 0, sizeof(event));
+        event.events = events;
+        event.data.fd = fd;
+        epoll_ctl(epollFd, operation, fd, &event);
+    }
+
+    void acceptClients() {
+        while (true) {
+            int client = accept4(listenFd, nullptr, nullptr, SOCK_NONBLOCK);
+            if (client == -1) {
+                return;
+            }
+            connections[client] = Connection();
+            watch(client, EPOLLIN, EPOLL_CTL_ADD);
+        }
+    }
+
+    void dropClient(int fd) {
+        epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, nullptr);
+        close(fd);
+        connections.erase(fd);
+    }
+
+    static uint32_t readUint32(const std::string& data, size_t offset) {
+        const unsigned char* bytes = reinterpret_cast<const unsigned char*>(data.data() + offset);
+        return bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) | (static_cast<uint32_t>(bytes[3]) << 24);
+    }
+
+    static void appendUint32(std::string& data, uint32_t value) {
+        for (int i = 0; i < 4; i++) {
+            data += static_cast<char>((value >> (8 * i)) & 0xff);
+        }
+    }
+
+    bool readClient(int fd) {
+        Connection& connection = connections[fd];
+        char buffer[65536];
+        while (true) {
+            ssize_t received = recv(fd, buffer, sizeof(buffer), 0);
+            if (received > 0) {
+                connection.input.append(buffer, received);
+            } else if (received == 0) {
+                return false;
+            } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            } else if (errno != EINTR) {
+                return false;
+            }
+        }
+
+        size_t offset = 0;
+        while (connection.input.size() - offset >= 4) {
+            uint32_t length = readUint32(connection.input, offset);
+            if (length > kMaxFrame || length < 2) {
+                return false;
+            }
+            if (connection.input.size() - offset - 4 < length) {
+                break;
+            }
+            handleRequest(connection.input.substr(offset + 4, length), connection.output);
+            offset += 4 + length;
+        }
+        connection.input.erase(0, offset);
+        return true;
+    }
+
+    void handleRequest(const std::string& frame, std::string& response) {
+        size_t nameLength = static_cast<unsigned char>(frame[0]) | (static_cast<unsigned char>(frame[1]) << 8);
+        std::ostringstream results;
+        size_t failures = 0;
+
+        if (nameLength + 2 > frame.size()) {
+            results << "error\t0\tmalformed request\n";
+            failures = 1;
+        } else {
+            StringArray& document = documents[frame.substr(2, nameLength)];
+            std::istringstream script(frame.substr(2 + nameLength));
+            BatchRunner runner(document, results);
+            failures = runner.run(script);
+        }
+
+        std::string body = results.str();
+        appendUint32(response, static_cast<uint32_t>(body.size() + 4));
+        appendUint32(response, static_cast<uint32_t>(failures));
+        response += body;
+    }
+
+    bool flushClient(int fd) {
+        Connection& connection = connections[fd];
+        while (connection.sent < connection.output.size()) {
+            ssize_t written = send(fd, connection.output.data() + connection.sent,
+                                   connection.output.size() - connection.sent, MSG_NOSIGNAL);
+            if (written > 0) {
+                connection.sent += written;
+            } else if (written == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                watch(fd, EPOLLIN | EPOLLOUT, EPOLL_CTL_MOD);
+                return true;
+            } else if (written == -1 && errno == EINTR) {
+                continue;
+            } else {
+                return false;
+            }
+        }
+
+        if (!connection.output.empty()) {
+            connection.output.clear();
+            connection.sent = 0;
+            watch(fd, EPOLLIN, EPOLL_CTL_MOD);
+        }
+        return true;
+    }
+};
+#endif
+
+// Runs tasks against pinned document versions on worker threads. Finished tasks leave a
+// report that the command loop prints before its next prompt.
+class BackgroundJobs {
+public:
+    ~BackgroundJobs() {
+        for (size_t i = 0; i < workers.size(); i++) {
+            workers[i].join();
+        }
+    }
+
+    void start(const std::string& name, const std::function<std::string()>& task) {
+        workers.push_back(std::thread([this, name, task]() {
+            TraceSpan span("BackgroundJobs::task");
+            std::string report;
+            try {
+                report = task();
+            } catch (const std::exception &e) {
+                report = "Error: " + std::string(e.what());
+            }
+
+            std::lock_guard<std::mutex> lock(mutex);
+            reports.push_back(name + " finished. " + report);
+            finished.push_back(std::this_thread::get_id());
+        }));
+    }
+
+    void reportFinished() {
+        std::vector<std::string> ready;
+        std::vector<std::thread::id> done;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            ready.swap(reports);
+            done.swap(finished);
+        }
+
+        for (size_t i = 0; i < done.size(); i++) {
+            for (size_t j = 0; j < workers.size(); j++) {
+                if (workers[j].get_id() == done[i]) {
+                    workers[j].join();
+                    workers.erase(workers.begin() + j);
+                    break;
+                }
+            }
+        }
+        for (size_t i = 0; i < ready.size(); i++) {
+            std::cout << ready[i] << std::endl;
+        }
+    }
+
+private:
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::vector<std::string> reports;
+    std::vector<std::thread::id> finished;
+};
+
+class Processes{
+private:
+    StringArray stringArray;
+    SearchCache searchCache;
+    BackgroundJobs backgroundJobs;
+    std::string fileName;
+
+    struct SaveProgress {
+        SaveProgress() : linesWritten(0), totalLines(0), cancelRequested(false), finished(false) {}
+
+        std::atomic<size_t> linesWritten;
+        size_t totalLines;
+        std::atomic<bool> cancelRequested;
+        std::atomic<bool> finished;
+        std::string fileName;
+    };
+
+    std::shared_ptr<SaveProgress> activeSave;
+    size_t memorySoftLimit;
+    bool memoryMeasured;
+    bool aboveMemoryLimit;
+    unsigned long long measuredRevision;
+    size_t measuredHistorySize;
+    size_t measuredClipboardBytes;
+    EditTrace trace;
+
+    void recordMemory(const StringArray::MemoryUsage& usage){
+        MemoryStats::update("array", usage.array);
+        MemoryStats::update("history", usage.history);
+        MemoryStats::update("redo", usage.redo);
+        MemoryStats::update("clipboard", usage.clipboard);
+    }
+
+    void rememberMeasurement(){
+        memoryMeasured = true;
+        measuredRevision = stringArray.getRevision();
+        measuredHistorySize = stringArray.getHistorySize();
+        measuredClipboardBytes = stringArray.getClipboardBytes();
+    }
+public:
+    Processes()
+        : memorySoftLimit(0), memoryMeasured(false), aboveMemoryLimit(false), measuredRevision(0),
+          measuredHistorySize(0), measuredClipboardBytes(0) {}
+
+    // Records every following edit, load and search into a binary trace for --replay.
+    bool startTrace(const std::string& traceFile){
+        if (!trace.open(traceFile)) {
+            return false;
+        }
+        stringArray.setTrace(&trace);
+        return true;
+    }
+
+    void reportBackgroundJobs(){
+        backgroundJobs.reportFinished();
+    }
+
+    // Updates the memory statistics once the document, its history or the clipboard changed
+    // since the last measurement. Above the soft limit, drops the oldest half of the undo
+    // history until the document fits or no older steps are left, warning once each time
+    // memory use goes over the limit.
+    void trackMemory(){
+        if (memoryMeasured && measuredRevision == stringArray.getRevision() &&
+            measuredHistorySize == stringArray.getHistorySize() &&
+            measuredClipboardBytes == stringArray.getClipboardBytes()) {
+            return;
+        }
+
+        StringArray::MemoryUsage usage = stringArray.measureMemory();
+        recordMemory(usage);
+        if (memorySoftLimit == 0 || usage.total() <= memorySoftLimit) {
+            aboveMemoryLimit = false;
+            rememberMeasurement();
+            return;
+        }
+
+        size_t before = usage.total();
+        size_t dropped = 0;
+        while (usage.total() > memorySoftLimit && stringArray.getHistorySize() > 1) {
+            dropped += stringArray.trimHistory((stringArray.getHistorySize() + 1) / 2);
+            usage = stringArray.measureMemory();
+        }
+        recordMemory(usage);
+        rememberMeasurement();
+
+        if (!aboveMemoryLimit) {
+            std::cerr << "Memory use of " << before << " bytes is above the soft limit of " << memorySoftLimit << " bytes";
+            if (dropped > 0) {
+                std::cerr << "; dropped the " << dropped << " oldest undo step(s), now " << usage.total() << " bytes";
+            }
+            std::cerr << "." << std::endl;
+        }
+        aboveMemoryLimit = usage.total() > memorySoftLimit;
+    }
+
+    void memoryUsage(){
+        trackMemory();
+        MemoryStats::print(std::cout);
+        if (memorySoftLimit > 0) {
+            std::cout << "Soft limit: " << memorySoftLimit << " bytes" << std::endl;
+        } else {
+            std::cout << "Soft limit: none" << std::endl;
+        }
+
+        bool change = false;
+        std::cout << "Change the soft limit (1 for yes, 0 for no): ";
+        std::cin >> change;
+        if (change) {
+            long long limitMiB = 0;
+            std::cout << "Enter soft limit in MiB (0 for none): ";
+            if (!(std::cin >> limitMiB) || limitMiB < 0 ||
+                static_cast<unsigned long long>(limitMiB) > (std::numeric_limits<size_t>::max() >> 20)) {
+                std::cin.clear();
+                std::cin.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+                std::cerr << "Invalid soft limit." << std::endl;
+                return;
+            }
+            memorySoftLimit = static_cast<size_t>(limitMiB) << 20;
+            memoryMeasured = false;
+            aboveMemoryLimit = false;
+            trackMemory();
+        }
+    }
+
+    void backgroundSave(){
+        if (activeSave && !activeSave->finished) {
+            std::cerr << "A save to " << activeSave->fileName << " is already running." << std::endl;
+            return;
+        }
+
+        std::cout << "Write file name to SAVE in the background: ";
+        std::cin >> fileName;
 
-    void process() {
-        int mode = 0;
-        std::cout << "Choose mode: 1 for Normal mode, 2 for Secret mode: ";
-        std::cin >> mode;
+        std::shared_ptr<const DocumentVersion> version = stringArray.snapshot();
+        std::shared_ptr<SaveProgress> progress = std::make_shared<SaveProgress>();
+        progress->totalLines = version->getLineCount();
+        progress->fileName = fileName;
+        activeSave = progress;
 
-        std::string inputFilePath, outputFilePath, key;
+        backgroundJobs.start("Background save to " + fileName, [version, progress]() {
+            std::string error;
+            bool saved = FilesSL::saveVersionToFile(progress->fileName, *version, progress->linesWritten,
+                                                    progress->cancelRequested, error);
+            progress->finished = true;
+            return saved ? "Array saved to " + progress->fileName : error;
+        });
+    }
 
-        // Normal mode
-        if (mode == 1) {
-            std::string operation;
-            std::cout << "Choose operation: 'encrypt' or 'decrypt': ";
-            std::cin >> operation;
+    void storageStats(){
+        const ArenaLineStore& lines = stringArray.getLines();
+        size_t textBytes = lines.getLiveBytes();
+        size_t storedBytes = lines.getStoredBytes();
 
-            std::cout << "Enter input file path: ";
-            std::cin >> inputFilePath;
+        std::cout << "Lines: " << lines.size() << ", shared with an identical line when loaded: " << lines.getSharedLines() << std::endl;
+        std::cout << "Text bytes: " << textBytes << ", stored bytes: " << storedBytes
+                  << ", arena bytes: " << lines.getArenaBytes() << std::endl;
+        if (storedBytes > 0) {
+            std::cout << "Dedup ratio: " << static_cast<double>(textBytes) / storedBytes << std::endl;
+        }
+    }
 
-            std::cout << "Enter output file path: ";
-            std::cin >> outputFilePath;
+    void operationStats(){
+#ifdef HM2PP_NO_STATS
+        std::cout << "Operation statistics are not compiled into this build." << std::endl;
+#else
+        OperationStats::print(std::cout);
 
-            std::cout << "Enter the key: ";
-            std::cin >> key;
+        bool dump = false;
+        std::cout << "Dump the statistics as JSON (1 for yes, 0 for no): ";
+        std::cin >> dump;
+        if (!dump) {
+            return;
+        }
 
-            try {
-                IReader *reader = new FileReader();
-                IWriter *writer = new FileWriter();
-                std::string content = reader->Read(inputFilePath);
+        std::string jsonFile;
+        std::cout << "Write file name for the JSON dump: ";
+        std::cin >> jsonFile;
+        std::ofstream output(jsonFile);
+        if (!output.is_open()) {
+            std::cerr << "Error opening the file." << std::endl;
+            return;
+        }
+        OperationStats::writeJson(output);
+        std::cout << "Statistics saved to " << jsonFile << std::endl;
+#endif
+    }
 
-                if (operation == "encrypt") {
-                    content = encryptionLibrary.encrypt(content, key);
-                } else if (operation == "decrypt") {
-                    content = encryptionLibrary.decrypt(content, key);
-                } else {
-                    std::cerr << "Invalid operation. Please choose 'encrypt' or 'decrypt'." << std::endl;
-                }
+    void timeline(){
+        if (!Timeline::isEnabled()) {
+            bool start = false;
+            std::cout << "Timeline recording is off. Start it (1 for yes, 0 for no): ";
+            std::cin >> start;
+            Timeline::setEnabled(start);
+            return;
+        }
 
-                writer->Write(outputFilePath, content);
-                std::cout << "Operation completed successfully." << std::endl;
+        std::string timelineFile;
+        std::cout << "Write file name for the timeline JSON: ";
+        std::cin >> timelineFile;
+        std::ofstream output(timelineFile);
+        if (!output.is_open()) {
+            std::cerr << "Error opening the file." << std::endl;
+            return;
+        }
+        size_t spans = Timeline::writeJson(output);
+        std::cout << spans << " span(s) saved to " << timelineFile << std::endl;
 
-                delete reader;
-                delete writer;
-                encryptionLibrary.~EncryptionLibrary();
-            } catch (const std::exception &e) {
-                std::cerr << "Error: " << e.what() << std::endl;
-            }
-        // Secret mode
-        } else if (mode == 2) {
-            RandomKeyGenerator keyGenerator;
+        bool keep = true;
+        std::cout << "Keep recording (1 for yes, 0 for no): ";
+        std::cin >> keep;
+        Timeline::setEnabled(keep);
+    }
 
-            std::cout << "Enter input file path: ";
-            std::cin >> inputFilePath;
+    void documentSummary(){
+        StringArray::Summary summary = stringArray.summarize();
+        std::cout << "Lines: " << summary.lines << ", words: " << summary.words << std::endl;
+        std::cout << "Bytes: " << summary.bytes << ", characters: " << summary.chars << std::endl;
+        std::cout << "Longest line: " << summary.longestLine << " bytes" << std::endl;
+    }
 
-            std::cout << "Enter output file path: ";
-            std::cin >> outputFilePath;
+    void offsetLookup(){
+        bool fromOffset = true;
+        std::cout << "Convert a byte offset to a line and position (1 for yes, 0 for the reverse): ";
+        std::cin >> fromOffset;
 
-            try {
-                IReader *reader = new FileReader();
-                IWriter *writer = new FileWriter();
-                std::string content = reader->Read(inputFilePath);
+        size_t lineIndex = 0, position = 0, offset = 0;
+        if (fromOffset) {
+            size_t textSize = stringArray.getTextSize();
+            std::cout << "Enter byte offset (0-" << (textSize > 0 ? textSize - 1 : 0) << "): ";
+            std::cin >> offset;
+            if (stringArray.offsetToPosition(offset, lineIndex, position)) {
+                std::cout << "Line " << lineIndex << ", position " << position << std::endl;
+            } else {
+                std::cerr << "Invalid offset." << std::endl;
+            }
+            return;
+        }
 
-                int randomKey = keyGenerator.GenerateRandomKey();
+        std::cout << "Enter line index: ";
+        std::cin >> lineIndex;
+        std::cout << "Enter position: ";
+        std::cin >> position;
+        if (stringArray.positionToOffset(lineIndex, position, offset)) {
+            std::cout << "Byte offset " << offset << std::endl;
+        } else {
+            std::cerr << "Invalid line or position." << std::endl;
+        }
+    }
 
-                content = encryptionLibrary.encrypt(content, std::to_string(randomKey));
+    void saveProgress(){
+        if (!activeSave) {
+            std::cout << "No background save has been started." << std::endl;
+            return;
+        }
 
-                writer->Write(outputFilePath, content);
-                std::cout << "Operation completed successfully." << std::endl;
+        size_t written = activeSave->linesWritten;
+        size_t total = activeSave->totalLines;
+        std::cout << "Save to " << activeSave->fileName << ": " << written << " of " << total << " lines written ("
+                  << (total == 0 ? 100 : written * 100 / total) << "%)"
+                  << (activeSave->finished ? ", finished." : ".") << std::endl;
 
-                delete reader;
-                delete writer;
-                encryptionLibrary.~EncryptionLibrary();
-            } catch (const std::exception &e) {
-                std::cerr << "Error: " << e.what() << std::endl;
+        if (!activeSave->finished) {
+            bool cancel = false;
+            std::cout << "Cancel the save (1 for yes, 0 for no): ";
+            std::cin >> cancel;
+            if (cancel) {
+                activeSave->cancelRequested = true;
             }
         }
     }
 
-private:
-    EncryptionLibrary encryptionLibrary;
-};
+    void backgroundSearch(){
+        std::string substring;
+
+        std::cout << "Enter substring to search for in the background: ";
+        std::getline(std::cin, substring);
+
+        if (substring.empty()) {
+            std::cerr << "Search text must not be empty." << std::endl;
+            return;
+        }
+
+        std::shared_ptr<const DocumentVersion> version = stringArray.snapshot();
+        backgroundJobs.start("Background search for '" + substring + "'", [version, substring]() {
+            std::ostringstream report;
+            std::string scratch;
+            size_t foundCount = 0;
+            for (size_t i = 0; i < version->getLineCount(); i++) {
+                size_t found = version->fetch(i, scratch).find(substring);
+                if (found != std::string::npos) {
+                    if (foundCount < 20) {
+                        report << "\nSubstring found in line " << i + 1 << " at position " << found;
+                    }
+                    foundCount++;
+                }
+            }
+            return "Lines with matches in revision " + std::to_string(version->getRevision()) + ": " +
+                   std::to_string(foundCount) + report.str();
+        });
+    }
 
-class Processes{
-private:
-    StringArray stringArray;
-    std::string fileName;
-public:
     void append(){
         std::string buffer;
         std::cout << "Write text to append: ";
@@ -457,16 +5665,80 @@ public:
         stringArray.printStrings();
     }
 
+    void view(){
+        PagedViewer viewer(stringArray);
+        std::string action;
+
+        std::cout << "Enter page size (0 for terminal height): ";
+        long long pageSize = 0;
+        if (!(std::cin >> pageSize) || pageSize < 0) {
+            std::cin.clear();
+            std::cin.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+            std::cerr << "Invalid page size." << std::endl;
+            return;
+        }
+        if (pageSize > 0) {
+            viewer.setPageSize(static_cast<size_t>(pageSize));
+        }
+
+        while (true) {
+            viewer.render();
+            std::cout << "n - next page, p - previous page, g - go to line, q - quit: ";
+            if (!(std::cin >> action) || action == "q") {
+                break;
+            }
+
+            if (action == "n") {
+                viewer.pageDown();
+            } else if (action == "p") {
+                viewer.pageUp();
+            } else if (action == "g") {
+                size_t lineIndex = 0;
+                std::cout << "Enter line number: ";
+                std::cin >> lineIndex;
+                viewer.jumpToLine(lineIndex);
+            }
+        }
+    }
+
+    void fullScreen(){
+        ScreenEditor editor(stringArray);
+        editor.run();
+    }
+
     void save(){
         std::cout << "Write file name to SAVE: ";
         std::cin >> fileName;
-        FilesSL::saveToFile(fileName, stringArray.getStrings());
+
+        TIME_OPERATION(timer, "Processes::save");
+        timer.touched(stringArray.getLines().getLiveBytes());
+        size_t patchedLines = 0;
+        if (FilesSL::patchChangedLines(fileName, stringArray, patchedLines)) {
+            stringArray.markPatched();
+            std::cout << "Array saved to " << fileName << " (" << patchedLines << " changed line(s) rewritten in place)" << std::endl;
+        } else if (FilesSL::saveToFile(fileName, stringArray.getLines())) {
+            stringArray.markSaved(fileName);
+        }
     }
 
     void load(){
         std::cout << "Write file name to LOAD: ";
         std::cin >> fileName;
-        stringArray.setStrings(FilesSL::loadFromFile(fileName));
+        loadFile(fileName);
+    }
+
+    void loadFile(const std::string& name){
+        fileName = name;
+        TIME_OPERATION(timer, "Processes::load");
+        ArenaLineStore lines;
+        FilesSL::loadIntoStore(fileName, lines);
+        timer.touched(lines.getLiveBytes());
+        if (trace.isOpen()) {
+            trace.begin(EditTrace::kLoad).text(fileName).integer(static_cast<long long>(lines.size()))
+                .integer(static_cast<long long>(TraceReplayer::documentChecksum(lines))).end();
+        }
+        stringArray.setLines(lines);
+        stringArray.markSaved(fileName);
     }
 
     void search(){
@@ -475,7 +5747,178 @@ public:
         std::cout << "Enter substring to search for: ";
         std::cin >> substring;
 
-        SearchFunctions::searchSubstringInArray(stringArray.getStrings(), substring);
+        if (trace.isOpen()) {
+            trace.begin(EditTrace::kSearch).text(substring).end();
+        }
+        TIME_OPERATION(timer, "Processes::search");
+        SearchFunctions::printSubstringMatches(searchCache.search(stringArray, substring), substring);
+    }
+
+    void regexSearch(){
+        std::string pattern;
+
+        std::cout << "Enter regular expression to search for: ";
+        std::getline(std::cin, pattern);
+
+        if (trace.isOpen()) {
+            trace.begin(EditTrace::kRegexSearch).text(pattern).end();
+        }
+        TIME_OPERATION(timer, "Processes::regexSearch");
+        timer.touched(stringArray.getLines().getLiveBytes());
+        try {
+            std::vector<SearchMatch> matches = SearchFunctions::searchRegexInArray(stringArray.getLines(), pattern);
+            SearchFunctions::printMatches(stringArray.getLines(), matches);
+        } catch (const std::exception &e) {
+            std::cerr << "Error: " << e.what() << std::endl;
+        }
+    }
+
+    void multiSearch(){
+        int mode = 0;
+        std::vector<std::string> patterns;
+
+        std::cout << "Choose pattern source: 1 to type patterns, 2 to read them from a file: ";
+        std::cin >> mode;
+        std::cin.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+
+        if (mode == 1) {
+            std::string line;
+            std::cout << "Enter patterns separated by ',': ";
+            std::getline(std::cin, line);
+
+            size_t start = 0;
+            while (start <= line.size()) {
+                size_t comma = line.find(',', start);
+                if (comma == std::string::npos) {
+                    comma = line.size();
+                }
+                patterns.push_back(line.substr(start, comma - start));
+                start = comma + 1;
+            }
+        } else if (mode == 2) {
+            std::string patternFile;
+            std::cout << "Enter file with one pattern per line: ";
+            std::getline(std::cin, patternFile);
+            std::ifstream file(patternFile);
+            if (!file.is_open()) {
+                std::cerr << "Error opening the file." << std::endl;
+                return;
+            }
+            std::string pattern;
+            while (std::getline(file, pattern)) {
+                patterns.push_back(pattern);
+            }
+        } else {
+            std::cerr << "Invalid mode." << std::endl;
+            return;
+        }
+
+        TIME_OPERATION(timer, "Processes::multiSearch");
+        timer.touched(stringArray.getLines().getLiveBytes());
+        AhoCorasick automaton(patterns);
+        if (automaton.getPatterns().empty()) {
+            std::cerr << "No patterns to search for." << std::endl;
+            return;
+        }
+
+        std::vector<PatternMatch> matches = SearchFunctions::searchPatternsInArray(stringArray.getLines(), automaton);
+        SearchFunctions::printPatternMatches(automaton, matches);
+    }
+
+    void fuzzySearch(){
+        std::string pattern;
+        int maxDistance = 0;
+
+        std::cout << "Enter text to search for: ";
+        std::getline(std::cin, pattern);
+
+        std::cout << "Enter maximum edit distance: ";
+        std::cin >> maxDistance;
+
+        if (maxDistance < 0) {
+            std::cerr << "Invalid distance." << std::endl;
+            return;
+        }
+
+        TIME_OPERATION(timer, "Processes::fuzzySearch");
+        timer.touched(stringArray.getLines().getLiveBytes());
+        try {
+            std::vector<FuzzyMatch> matches = SearchFunctions::fuzzySearchInArray(stringArray.getLines(), pattern, maxDistance);
+            SearchFunctions::printFuzzyMatches(stringArray.getLines(), matches);
+        } catch (const std::exception &e) {
+            std::cerr << "Error: " << e.what() << std::endl;
+        }
+    }
+
+    void grepFiles(){
+        int mode = 0;
+        std::string paths, pattern;
+
+        std::cout << "Enter file paths separated by spaces: ";
+        std::getline(std::cin, paths);
+
+        std::cout << "Choose mode: 1 for literal text, 2 for regular expression: ";
+        std::cin >> mode;
+        std::cin.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+
+        if (mode != 1 && mode != 2) {
+            std::cerr << "Invalid mode." << std::endl;
+            return;
+        }
+
+        std::cout << "Enter text to search for: ";
+        std::getline(std::cin, pattern);
+
+        std::vector<std::string> fileNames;
+        std::istringstream stream(paths);
+        std::string path;
+        while (stream >> path) {
+            fileNames.push_back(path);
+        }
+
+        TIME_OPERATION(timer, "Processes::grepFiles");
+        try {
+            size_t total = 0;
+            SearchFunctions::searchFilesOnDisk(fileNames, pattern, mode == 2, [&](const GrepResult& result) {
+                total += SearchFunctions::printGrepResult(result);
+            });
+            std::cout << "Total matches: " << total << std::endl;
+        } catch (const std::exception &e) {
+            std::cerr << "Error: " << e.what() << std::endl;
+        }
+    }
+
+    void replace(){
+        int mode = 0;
+        std::string pattern, replacement;
+
+        std::cout << "Choose mode: 1 for literal text, 2 for regular expression: ";
+        std::cin >> mode;
+        std::cin.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+
+        if (mode != 1 && mode != 2) {
+            std::cerr << "Invalid mode." << std::endl;
+            return;
+        }
+
+        std::cout << "Enter text to find: ";
+        std::getline(std::cin, pattern);
+
+        std::cout << "Enter replacement text: ";
+        std::getline(std::cin, replacement);
+
+        TIME_OPERATION(timer, "Processes::replace");
+        timer.touched(stringArray.getLines().getLiveBytes());
+        try {
+            std::vector<size_t> changedLines;
+            std::vector<std::string> contents;
+            size_t replaced = SearchFunctions::replaceAllInArray(stringArray.getLines(), pattern, replacement,
+                                                                 mode == 2, changedLines, contents);
+            stringArray.replaceLines(changedLines, contents);
+            std::cout << "Replaced " << replaced << " occurrence(s) in " << changedLines.size() << " line(s)." << std::endl;
+        } catch (const std::exception &e) {
+            std::cerr << "Error: " << e.what() << std::endl;
+        }
     }
 
     void insert(){
@@ -513,7 +5956,7 @@ public:
     }
 
     void redo(){
-        stringArray.undo();
+        stringArray.redo();
     }
 
     void cut(){
@@ -544,12 +5987,23 @@ public:
     }
 };
 
-int main() {
-    Processes processes;
+// Tools that reuse the editor classes, such as the benchmarks, define HM2PP_NO_MAIN before
+// including this file.
+#ifndef HM2PP_NO_MAIN
+int runInteractive(Processes& processes, const std::string& traceFile, const std::string& startupFile) {
+    if (!traceFile.empty() && !processes.startTrace(traceFile)) {
+        std::cerr << "Error opening the trace file." << std::endl;
+        return 1;
+    }
+    if (!startupFile.empty()) {
+        try {
+            processes.loadFile(startupFile);
+        } catch (const std::exception &e) {
+            std::cerr << "Error: " << e.what() << std::endl;
+        }
+    }
 
     int command = 0;
-    StringArray stringArray;
-    std::string fileName;
     std::cout << "Commands:\n"
                  "1 - Append text\n"
                  "2 - Add empty line\n"
@@ -564,10 +6018,28 @@ int main() {
                  "11 - Cut\n"
                  "12 - Copy\n"
                  "13 - Paste\n"
-                 "14 - Encryptor\n";
+                 "14 - Encryptor\n"
+                 "15 - Regex search\n"
+                 "16 - Multi-pattern search\n"
+                 "17 - Replace all\n"
+                 "18 - Fuzzy search\n"
+                 "19 - Search files on disk\n"
+                 "20 - Page through text\n"
+                 "21 - Full-screen editor\n"
+                 "22 - Background search\n"
+                 "23 - Background save\n"
+                 "24 - Background save progress\n"
+                 "25 - Storage statistics\n"
+                 "26 - Operation statistics\n"
+                 "27 - Memory usage\n"
+                 "28 - Timeline trace\n"
+                 "29 - Offset lookup\n"
+                 "30 - StringArray summary\n";
 
     while (true) {
-        std::cout << "Write command 1-14: ";
+        processes.reportBackgroundJobs();
+        processes.trackMemory();
+        std::cout << "Write command 1-30: ";
         std::cin >> command;
         std::cin.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
 
@@ -642,12 +6114,151 @@ int main() {
 
                 break;
             }
+            case 15: {
+                processes.regexSearch();
+
+                break;
+            }
+            case 16: {
+                processes.multiSearch();
+
+                break;
+            }
+            case 17: {
+                processes.replace();
+
+                break;
+            }
+            case 18: {
+                processes.fuzzySearch();
+
+                break;
+            }
+            case 19: {
+                processes.grepFiles();
+
+                break;
+            }
+            case 20: {
+                processes.view();
+
+                break;
+            }
+            case 21: {
+                processes.fullScreen();
+
+                break;
+            }
+            case 22: {
+                processes.backgroundSearch();
+
+                break;
+            }
+            case 23: {
+                processes.backgroundSave();
+
+                break;
+            }
+            case 24: {
+                processes.saveProgress();
+
+                break;
+            }
+            case 25: {
+                processes.storageStats();
+
+                break;
+            }
+            case 26: {
+                processes.operationStats();
+
+                break;
+            }
+            case 27: {
+                processes.memoryUsage();
+
+                break;
+            }
+            case 28: {
+                processes.timeline();
+
+                break;
+            }
+            case 29: {
+                processes.offsetLookup();
+
+                break;
+            }
+            case 30: {
+                processes.documentSummary();
+
+                break;
+            }
             default: {
-                if (command < 0 || command > 14) {
+                if (command < 0 || command > 30) {
                     std::cout << "The command is not implemented." << std::endl;
                 }
                 break;
             }
         }
     }
-}
\ No newline at end of file
+}
+
+int main(int argc, char* argv[]) {
+    if (argc > 1 && std::string(argv[1]) == "--batch") {
+        std::ios::sync_with_stdio(false);
+        StringArray stringArray;
+        BatchRunner runner(stringArray, std::cout);
+        if (argc > 2) {
+            std::ifstream script(argv[2]);
+            if (!script.is_open()) {
+                std::cerr << "Error opening the script." << std::endl;
+                return 1;
+            }
+            return runner.run(script) == 0 ? 0 : 1;
+        }
+        return runner.run(std::cin) == 0 ? 0 : 1;
+    }
+
+    if (argc > 2 && std::string(argv[1]) == "--server") {
+#ifdef __linux__
+        try {
+            EditorServer server(argv[2]);
+            server.run();
+        } catch (const std::exception &e) {
+            std::cerr << "Error: " << e.what() << std::endl;
+            return 1;
+        }
+        return 0;
+#else
+        std::cerr << "Server mode is only available on Linux." << std::endl;
+        return 1;
+#endif
+    }
+
+    if (argc > 2 && std::string(argv[1]) == "--replay") {
+        try {
+            TraceReplayer replayer(std::cout);
+            replayer.run(argv[2]);
+        } catch (const std::exception &e) {
+            std::cerr << "Error: " << e.what() << std::endl;
+            return 1;
+        }
+        return 0;
+    }
+
+    std::string traceFile;
+    std::string startupFile;
+    int arg = 1;
+    if (argc > 2 && std::string(argv[1]) == "--trace") {
+        traceFile = argv[2];
+        arg = 3;
+    }
+    if (arg < argc) {
+        startupFile = argv[arg];
+    }
+
+    Processes processes;
+    return runInteractive(processes, traceFile, startupFile);
+}
+#endif
@@ -0,0 +1,39 @@
+# Runs the profile-guided optimization training workload against an instrumented Hm2PP.
+# Invoked by the pgo-train target with HM2PP, WORKLOAD, WORK_DIR, PROFILE_DIR and,
+# for Clang builds, LLVM_PROFDATA defined.
+
+file(MAKE_DIRECTORY "${WORK_DIR}")
+
+# A document with distinct lines, so the edit, search and save paths see realistic data.
+set(document "")
+foreach(i RANGE 1 20000)
+    math(EXPR value "${i} * 7919 % 10007")
+    string(APPEND document "${i}: lorem ipsum dolor sit amet ${value}, consectetur adipiscing elit\n")
+    if(i EQUAL 2000 OR i EQUAL 12000)
+        string(APPEND document "\n")
+    endif()
+endforeach()
+file(WRITE "${WORK_DIR}/pgo-document.txt" "${document}")
+
+foreach(round RANGE 1 3)
+    execute_process(
+        COMMAND "${HM2PP}" --batch "${WORKLOAD}"
+        WORKING_DIRECTORY "${WORK_DIR}"
+        RESULT_VARIABLE result
+        OUTPUT_QUIET)
+    if(NOT result EQUAL 0)
+        message(FATAL_ERROR "Training workload failed with ${result}")
+    endif()
+endforeach()
+
+if(LLVM_PROFDATA)
+    file(GLOB raw_profiles "${PROFILE_DIR}/*.profraw")
+    execute_process(
+        COMMAND "${LLVM_PROFDATA}" merge -output=${PROFILE_DIR}/default.profdata ${raw_profiles}
+        RESULT_VARIABLE result)
+    if(NOT result EQUAL 0)
+        message(FATAL_ERROR "llvm-profdata merge failed with ${result}")
+    endif()
+endif()
+
+message(STATUS "Profiles written to ${PROFILE_DIR}")